@@ -0,0 +1,304 @@
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench.hpp"
+#include "command.hpp"
+#include "interpolation.hpp"
+#include "keyboard.hpp"
+#include "misc.hpp"
+#include "network.hpp"
+#include "obj_loader.hpp"
+#include "player.hpp"
+#include "world.hpp"
+
+#if _COMPRESSION
+#include "compression.hpp"
+#endif
+
+namespace {
+  const size_t PLAYER_COUNTS[] = { 1, 16, 64, 255, world::MAX_PLAYERS };
+
+  world make_world(size_t players) {
+    world w;
+
+    for (size_t i = 0; i < players; i++) {
+      player p;
+      w.add_player(p);
+    }
+
+    return w;
+  }
+
+  // every player moved and turned a little, as between two snapshots
+  world make_moved_world(const world& w) {
+    world moved = w;
+
+    for (player& p : moved.get_players()) {
+      p.set_x(p.get_x() + 0.1f);
+      p.set_z(p.get_z() - 0.1f);
+      p.set_horz_angel(p.get_horz_angel() + 0.05f);
+    }
+
+    return moved;
+  }
+
+  command make_command(int id) {
+    command c;
+    c.id = id;
+    c.buttons = keyboard::button::forward | keyboard::button::left;
+    c.horz_delta_angel = 0.01f;
+    c.vert_delta_angel = 0;
+    c.duration_ms = 16;
+    return c;
+  }
+
+  // build_message and deserialize of one message
+  template <typename T>
+  void bench_message(bench& b, const std::string& name, size_t players, const T& object) {
+    std::vector<uint8_t> message;
+
+    b.run("build_message/" + name, players, 1, [&](size_t iterations, bench::timer& t) {
+      for (size_t i = 0; i < iterations; i++) {
+        message.clear();
+        network::build_message(message, object);
+        keep(message.data());
+      }
+    });
+
+    message.clear();
+    network::build_message(message, object);
+    network::message_body body(message.data() + network::HEADER_SIZE,
+        message.size() - network::HEADER_SIZE);
+
+    b.run("deserialize/" + name, players, 1, [&](size_t iterations, bench::timer& t) {
+      for (size_t i = 0; i < iterations; i++) {
+        T decoded;
+        network::deserialize(decoded, body);
+        keep(decoded);
+      }
+    });
+  }
+
+  void bench_messages(bench& b) {
+    network::join_request join;
+    join.player_color_AABBGGRR = 0xff8090a0;
+    join.room = 7;
+    bench_message(b, "join_request", 0, join);
+
+    network::server_accept accept;
+    accept.player_id = 2048;
+    accept.udp_token = 0x12345678;
+    bench_message(b, "server_accept", 0, accept);
+
+    network::server_deny deny;
+    deny.reason = "server full";
+    bench_message(b, "server_deny", 0, deny);
+
+    network::snapshot_ack ack;
+    ack.sequence = 1000;
+    bench_message(b, "snapshot_ack", 0, ack);
+
+    network::command_batch batch;
+    for (int i = 0; i < 4; i++)
+      batch.commands.push_back(make_command(i + 1));
+    bench_message(b, "command_batch", 0, batch);
+
+    for (size_t players : PLAYER_COUNTS) {
+      world baseline = make_world(players);
+      world current = make_moved_world(baseline);
+
+      network::world_delta full(world(), current);
+      full.sequence = 2;
+      bench_message(b, "world_delta/full", players, full);
+
+      network::world_delta moved(baseline, current);
+      moved.sequence = 2;
+      moved.baseline_sequence = 1;
+      bench_message(b, "world_delta/moved", players, moved);
+
+#if _COMPRESSION
+      std::vector<uint8_t> body;
+      network::build_message(body, full);
+
+      network::compressor compressor;
+      network::compressed_message compressed;
+      compressed.dictionary_sequence = 0;
+      compressed.size = body.size() - network::HEADER_SIZE;
+
+      if (compressor.compress(body.data() + network::HEADER_SIZE, compressed.size, nullptr, 0,
+          compressed.data))
+        bench_message(b, "compressed_message", players, compressed);
+#endif
+    }
+  }
+
+  void bench_player(bench& b) {
+    player p;
+    command c = make_command(1);
+
+    b.run("player/run_command", 1, 1, [&](size_t iterations, bench::timer& t) {
+      for (size_t i = 0; i < iterations; i++) {
+        p.run_command(c);
+        keep(p);
+      }
+    });
+  }
+
+  void bench_world(bench& b) {
+    for (size_t players : PLAYER_COUNTS) {
+      world filled = make_world(players);
+      std::vector<uint16_t> ids;
+
+      for (const player& p : filled.get_players())
+        ids.push_back(p.get_id());
+
+      b.run("world/get_player", players, 1, [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++)
+          keep(filled.get_player(ids[i % ids.size()]).get().get_x());
+      });
+
+      std::vector<command> commands;
+      for (size_t i = 0; i < players; i++)
+        commands.push_back(make_command(i + 1));
+
+      // a round of commands of every player in one batch, per player
+      b.run("world/run_commands", players, players, [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++) {
+          filled.run_commands(ids, commands);
+          keep(filled);
+        }
+      });
+
+      // the same round one player after the other, for comparison, per player
+      b.run("world/run_command", players, players, [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++) {
+          for (size_t n = 0; n < players; n++)
+            filled.run_command(commands[n], ids[n]);
+
+          keep(filled);
+        }
+      });
+
+      // filling a world up to players, per player added
+      b.run("world/add_player", players, players, [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++) {
+          t.stop();
+          world w;
+          t.start();
+
+          for (size_t n = 0; n < players; n++) {
+            player p;
+            w.add_player(p);
+          }
+
+          t.stop();
+          keep(w);
+          w = world();
+          t.start();
+        }
+      });
+
+      // emptying a world of players, per player removed
+      b.run("world/remove_player", players, players, [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++) {
+          t.stop();
+          world w = filled;
+          t.start();
+
+          for (uint16_t id : ids)
+            w.remove_player(id);
+
+          keep(w);
+        }
+      });
+    }
+  }
+
+  void bench_interpolation(bench& b) {
+    const uint64_t SNAPSHOT_INTERVAL_MS = 50;
+    const size_t SNAPSHOTS = 2 * network::INTERPOLATION_TIME_MS / SNAPSHOT_INTERVAL_MS;
+
+    for (size_t players : PLAYER_COUNTS) {
+      network::world_snapshot from(make_world(players));
+      network::world_snapshot to(make_moved_world(from.snapshot));
+      from.client_time_ms = 1000;
+      to.client_time_ms = 1000 + SNAPSHOT_INTERVAL_MS;
+      world rendered = to.snapshot;
+
+      b.run("interpolation/interpolate", players, 1, [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++) {
+          interpolation::interpolate(rendered, 0, from, to, 1000 + i % SNAPSHOT_INTERVAL_MS);
+          keep(rendered);
+        }
+      });
+
+      // snapshots received over twice the interpolation time, the older half is dropped
+      std::list<network::world_snapshot> received;
+      for (size_t i = 0; i < SNAPSHOTS; i++) {
+        received.push_back(from);
+        received.back().client_time_ms = 1000 + i * SNAPSHOT_INTERVAL_MS;
+      }
+
+      uint64_t render_time = received.back().client_time_ms - network::INTERPOLATION_TIME_MS;
+
+      b.run("interpolation/remove_old_world_snapshots", players, 1,
+          [&](size_t iterations, bench::timer& t) {
+        for (size_t i = 0; i < iterations; i++) {
+          t.stop();
+          std::list<network::world_snapshot> snapshots = received;
+          t.start();
+
+          interpolation::remove_old_world_snapshots(snapshots, render_time,
+              network::INTERPOLATION_TIME_MS);
+
+          t.stop();
+          keep(snapshots);
+          snapshots.clear();
+          t.start();
+        }
+      });
+    }
+  }
+
+  void bench_obj_loader(bench& b, const char* file) {
+    std::string data = misc::get_file_content(file);
+
+    if (data.empty()) {
+      std::cerr << "skipping obj_loader, could not read: " << file << std::endl;
+      return;
+    }
+
+    b.run("obj_loader/get_geometry_data", 0, 1, [&](size_t iterations, bench::timer& t) {
+      for (size_t i = 0; i < iterations; i++) {
+        std::istringstream stream(data);
+        std::vector<float> vertices, normals;
+        obj_loader::get_geometry_data(stream, vertices, normals);
+        keep(vertices.data());
+      }
+    });
+  }
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc > 2) {
+    std::cout << "Usage: " << argv[0] << " [filter]" << std::endl << std::endl;
+    std::cout << "filter: only run benchmarks whose name contains it" << std::endl;
+
+    return 1;
+  }
+
+  bench b(argc > 1 ? argv[1] : "");
+
+  bench_messages(b);
+  bench_player(b);
+  bench_world(b);
+  bench_interpolation(b);
+  bench_obj_loader(b, "mask.obj");
+
+  b.write_json(std::cout, { { "text_archive", _TEXT_ARCHIVE }, { "compression", _COMPRESSION },
+      { "max_players", world::MAX_PLAYERS } });
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+#ifndef BENCH_HPP_
+#define BENCH_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//
+// Microbenchmark runner. A case is a function run for a number of iterations, each doing a fixed
+// number of operations; the iteration count is calibrated until a run takes RUN_TIME_NS of wall
+// time, then RUNS runs are timed and the median and fastest time per operation are kept. Cases
+// may stop the timer around preparation that should not count. Results are written as json.
+//
+
+class bench {
+public:
+  static const int RUNS = 5;
+  static const uint64_t RUN_TIME_NS = 100 * 1000 * 1000;
+  static const uint64_t CALIBRATION_TIME_NS = 10 * 1000 * 1000;
+
+  // time of the operations of a run, without the parts between stop and start
+  class timer {
+  public:
+    timer()
+      : elapsed_ns_(0)
+    {
+      start();
+    }
+
+    void start() {
+      start_ = std::chrono::steady_clock::now();
+    }
+
+    void stop() {
+      elapsed_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_).count();
+    }
+
+    uint64_t get_elapsed_ns() const {
+      return elapsed_ns_;
+    }
+
+  private:
+    std::chrono::steady_clock::time_point start_;
+    uint64_t elapsed_ns_;
+  };
+
+  struct result {
+    std::string name;
+    size_t players;
+    uint64_t iterations; // per run
+    size_t operations; // per iteration
+    double median_ns; // per operation
+    double min_ns;
+  };
+
+  // only cases whose name contains filter are run
+  bench(const std::string& filter = "")
+    : filter_(filter)
+  {
+  }
+
+  // f(size_t iterations, timer& t) does operations per iteration and leaves t started, players
+  // is the world size it works on, 0 if there is none
+  template <typename Function>
+  void run(const std::string& name, size_t players, size_t operations, Function f) {
+    if (name.find(filter_) == std::string::npos)
+      return;
+
+    // runs are sized by wall time, which includes the preparation of cases that stop the timer
+    uint64_t iterations = 1;
+    uint64_t wall_ns;
+
+    while (time(iterations, f, wall_ns), wall_ns < CALIBRATION_TIME_NS)
+      iterations *= 10;
+
+    iterations = std::max<uint64_t>(1, iterations * RUN_TIME_NS / wall_ns);
+
+    std::vector<double> times_ns;
+    for (int i = 0; i < RUNS; i++)
+      times_ns.push_back(static_cast<double>(time(iterations, f, wall_ns)) / iterations
+          / operations);
+
+    std::sort(times_ns.begin(), times_ns.end());
+    results_.push_back({ name, players, iterations, operations, times_ns[RUNS / 2],
+        times_ns.front() });
+  }
+
+  void write_json(std::ostream& out, const std::vector<std::pair<std::string, int>>& build) const {
+    out << "{\n  \"build\": {";
+
+    for (size_t i = 0; i < build.size(); i++)
+      out << (i ? ", " : " ") << "\"" << build[i].first << "\": " << build[i].second;
+
+    out << " },\n  \"benchmarks\": [";
+
+    for (size_t i = 0; i < results_.size(); i++) {
+      const result& r = results_[i];
+      out << (i ? "," : "") << "\n    { \"name\": \"" << r.name << "\", \"players\": "
+          << r.players << ", \"iterations\": " << r.iterations << ", \"operations\": "
+          << r.operations << ", \"median_ns\": " << r.median_ns << ", \"min_ns\": " << r.min_ns
+          << " }";
+    }
+
+    out << "\n  ]\n}" << std::endl;
+  }
+
+private:
+  // returns the timed part of a run
+  template <typename Function>
+  static uint64_t time(uint64_t iterations, Function& f, uint64_t& wall_ns) {
+    timer wall;
+    timer t;
+    f(iterations, t);
+    t.stop();
+    wall.stop();
+    wall_ns = std::max<uint64_t>(1, wall.get_elapsed_ns());
+    return t.get_elapsed_ns();
+  }
+
+  std::string filter_;
+  std::vector<result> results_;
+};
+
+// keeps the compiler from dropping a computed value
+template <typename T>
+void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+#endif // BENCH_HPP_
@@ -0,0 +1,180 @@
+#ifndef BINARY_ARCHIVE_HPP_
+#define BINARY_ARCHIVE_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <boost/serialization/access.hpp>
+
+namespace network {
+  //
+  // Fixed-layout little-endian archives. They drive the same serialize() members as the boost
+  // archives, but write integers and floats with their exact size, strings and vectors with a
+  // 32-bit element count, and no class or version information.
+  //
+
+  class binary_oarchive {
+  public:
+    using is_loading = std::false_type;
+    using is_saving = std::true_type;
+
+    binary_oarchive(std::vector<uint8_t>& data)
+      : data_(data)
+    {
+    }
+
+    template <typename T>
+    binary_oarchive& operator&(const T& value) {
+      return *this << value;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, binary_oarchive&>::type
+    operator<<(const T& value) {
+      write_integer(static_cast<typename std::make_unsigned<T>::type>(value), sizeof(T));
+      return *this;
+    }
+
+    binary_oarchive& operator<<(const float& value) {
+      uint32_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      write_integer(bits, sizeof(bits));
+      return *this;
+    }
+
+    binary_oarchive& operator<<(const std::string& value) {
+      write_integer(static_cast<uint32_t>(value.size()), sizeof(uint32_t));
+      data_.insert(data_.end(), value.begin(), value.end());
+      return *this;
+    }
+
+    template <typename T>
+    binary_oarchive& operator<<(const std::vector<T>& values) {
+      write_integer(static_cast<uint32_t>(values.size()), sizeof(uint32_t));
+      for (const T& v : values)
+        *this << v;
+      return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_class<T>::value, binary_oarchive&>::type
+    operator<<(const T& object) {
+      boost::serialization::access::serialize(*this, const_cast<T&>(object), 0);
+      return *this;
+    }
+
+  private:
+    template <typename U>
+    void write_integer(U value, size_t size) {
+      for (size_t i = 0; i < size; i++)
+        data_.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+    }
+
+    std::vector<uint8_t>& data_;
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  // bytes binary_oarchive writes for fields of integer or float types, for the MAX_SIZE of
+  // messages, given the types of their fields in serialize order
+  template <typename T>
+  constexpr size_t archived_size() {
+    static_assert(std::is_arithmetic<T>::value, "error, only integers and floats have a size");
+    return sizeof(T);
+  }
+
+  template <typename T, typename U, typename... Rest>
+  constexpr size_t archived_size() {
+    return archived_size<T>() + archived_size<U, Rest...>();
+  }
+
+  // bytes of a vector or string of at most max_count elements, each at most element_size
+  constexpr size_t archived_size(size_t max_count, size_t element_size) {
+    return sizeof(uint32_t) + max_count * element_size;
+  }
+
+  ///////////////////////////////////////////////////////////////////
+
+  class binary_iarchive {
+  public:
+    using is_loading = std::true_type;
+    using is_saving = std::false_type;
+
+    binary_iarchive(const uint8_t* begin, const uint8_t* end)
+      : pos_(begin),
+        end_(end)
+    {
+    }
+
+    template <typename T>
+    binary_iarchive& operator&(T& value) {
+      return *this >> value;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, binary_iarchive&>::type
+    operator>>(T& value) {
+      value = static_cast<T>(read_integer(sizeof(T)));
+      return *this;
+    }
+
+    binary_iarchive& operator>>(float& value) {
+      uint32_t bits = static_cast<uint32_t>(read_integer(sizeof(bits)));
+      std::memcpy(&value, &bits, sizeof(value));
+      return *this;
+    }
+
+    binary_iarchive& operator>>(std::string& value) {
+      size_t size = read_size(1);
+      value.assign(pos_, pos_ + size);
+      pos_ += size;
+      return *this;
+    }
+
+    template <typename T>
+    binary_iarchive& operator>>(std::vector<T>& values) {
+      values.resize(read_size(1));
+      for (T& v : values)
+        *this >> v;
+      return *this;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_class<T>::value, binary_iarchive&>::type
+    operator>>(T& object) {
+      boost::serialization::access::serialize(*this, object, 0);
+      return *this;
+    }
+
+  private:
+    uint64_t read_integer(size_t size) {
+      require(size);
+
+      uint64_t value = 0;
+      for (size_t i = 0; i < size; i++)
+        value |= static_cast<uint64_t>(*pos_++) << (8 * i);
+
+      return value;
+    }
+
+    // reads an element count and checks that the remaining data can hold it
+    size_t read_size(size_t min_element_size) {
+      size_t size = static_cast<size_t>(read_integer(sizeof(uint32_t)));
+      require(size * min_element_size);
+      return size;
+    }
+
+    void require(size_t size) {
+      if (static_cast<size_t>(end_ - pos_) < size)
+        throw std::runtime_error("error, binary_iarchive: unexpected end of data");
+    }
+
+    const uint8_t* pos_;
+    const uint8_t* end_;
+  };
+}
+
+#endif // BINARY_ARCHIVE_HPP_
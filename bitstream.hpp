@@ -0,0 +1,104 @@
+#ifndef BITSTREAM_HPP_
+#define BITSTREAM_HPP_
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace network {
+  // packs values of 1-32 bits, least significant bit first, into a byte vector
+  class bit_writer {
+  public:
+    bit_writer(std::vector<uint8_t>& data)
+      : data_(data),
+        scratch_(0),
+        scratch_bits_(0)
+    {
+    }
+
+    ~bit_writer() {
+      flush();
+    }
+
+    void write(uint32_t value, int bits) {
+      if (bits < 32)
+        value &= (uint32_t(1) << bits) - 1;
+
+      scratch_ |= static_cast<uint64_t>(value) << scratch_bits_;
+      scratch_bits_ += bits;
+
+      while (scratch_bits_ >= 8) {
+        data_.push_back(static_cast<uint8_t>(scratch_));
+        scratch_ >>= 8;
+        scratch_bits_ -= 8;
+      }
+    }
+
+    void write_bool(bool value) {
+      write(value ? 1 : 0, 1);
+    }
+
+    // bits in the byte vector, including bits not flushed yet
+    size_t get_bit_count() const {
+      return data_.size() * 8 + scratch_bits_;
+    }
+
+    // writes the remaining bits, padded with zeros to a whole byte
+    void flush() {
+      if (scratch_bits_) {
+        data_.push_back(static_cast<uint8_t>(scratch_));
+        scratch_ = 0;
+        scratch_bits_ = 0;
+      }
+    }
+
+  private:
+    std::vector<uint8_t>& data_;
+    uint64_t scratch_;
+    int scratch_bits_;
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  class bit_reader {
+  public:
+    bit_reader(const std::vector<uint8_t>& data)
+      : data_(data),
+        pos_(0),
+        scratch_(0),
+        scratch_bits_(0)
+    {
+    }
+
+    uint32_t read(int bits) {
+      while (scratch_bits_ < bits) {
+        if (pos_ == data_.size())
+          throw std::runtime_error("error, bit_reader: unexpected end of data");
+
+        scratch_ |= static_cast<uint64_t>(data_[pos_++]) << scratch_bits_;
+        scratch_bits_ += 8;
+      }
+
+      uint32_t value = static_cast<uint32_t>(scratch_);
+      if (bits < 32)
+        value &= (uint32_t(1) << bits) - 1;
+
+      scratch_ >>= bits;
+      scratch_bits_ -= bits;
+
+      return value;
+    }
+
+    bool read_bool() {
+      return read(1);
+    }
+
+  private:
+    const std::vector<uint8_t>& data_;
+    size_t pos_;
+    uint64_t scratch_;
+    int scratch_bits_;
+  };
+}
+
+#endif // BITSTREAM_HPP_
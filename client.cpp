@@ -5,8 +5,15 @@
 #include "misc.hpp"
 
 int main(int argc, char const *argv[]) {
-  if (argc < 4 || !misc::is_number(argv[2]) || (strcmp(argv[3], "2d") && strcmp(argv[3], "3d"))) {
-    std::cout << "Usage: " << argv[0] << " <host> <port> 2d|3d" << std::endl << std::endl;
+  bool udp_only = argc > 4 && !strcmp(argv[4], "udp");
+  int room_arg = udp_only ? 5 : 4;
+
+  if (argc < 4 || !misc::is_number(argv[2]) || (strcmp(argv[3], "2d") && strcmp(argv[3], "3d"))
+      || (argc > room_arg && !misc::is_number(argv[room_arg])) || argc > room_arg + 1) {
+    std::cout << "Usage: " << argv[0] << " <host> <port> 2d|3d [udp] [room]" << std::endl
+        << std::endl;
+    std::cout << "udp: connect over udp only, without tcp" << std::endl;
+    std::cout << "room: world to join on the server, 0 by default" << std::endl << std::endl;
     std::cout << "2d-controls: " << std::endl;
     std::cout << "  Move around with the arrow keys" << std::endl;
     std::cout << "3d-controls: " << std::endl;
@@ -35,7 +42,8 @@ int main(int argc, char const *argv[]) {
     else
       interface = new ui_sdl(title); // 2d
 
-    client(argv[1], argv[2], *interface).join_game();
+    uint32_t room = argc > room_arg ? std::stoul(argv[room_arg]) : 0;
+    client(argv[1], argv[2], *interface, udp_only, client::COMMAND_SEND_RATE, room).join_game();
 
     delete interface;
   } catch (std::exception& e) {
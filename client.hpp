@@ -1,13 +1,16 @@
 #ifndef CLIENT_HPP_
 #define CLIENT_HPP_
 
+#include <array>
 #include <atomic>
 #include <cstdint>
+#include <deque>
 #include <mutex>
 #include <thread>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/optional.hpp>
+#include "interpolation.hpp"
 #include "keyboard.hpp"
 #include "misc.hpp"
 #include "network.hpp"
@@ -18,23 +21,44 @@
 class client {
 public:
   static const int MAIN_LOOP_SLEEP_MS = 15;
-  static const int INTERPOLATION_TIME_MS = 300;
+  static const int INTERPOLATION_TIME_MS = network::INTERPOLATION_TIME_MS;
+  static const int COMMAND_SEND_RATE = 20; // per second
+  static const size_t REDUNDANT_COMMANDS = 4; // sent commands repeated in each udp batch
 
-  client(std::string host, std::string port, ui& interface)
+  client(std::string host, std::string port, ui& interface, bool udp_only = false,
+      int command_send_rate = COMMAND_SEND_RATE, uint32_t room = 0)
     : player_id_(0),
       game_time_ms_(0),
+      reader_(network::MAX_SERVER_FRAME_SIZE),
       io_service_(),
+      write_strand_(io_service_),
       socket_(io_service_),
+      write_queue_(new network::outbound_queue(write_strand_, socket_, network::write_limits())),
       resolver_(io_service_),
       endpoint_iterator_(resolver_.resolve({ host, port })),
+      udp_socket_(io_service_),
+      udp_token_(0),
+      udp_only_(udp_only),
+      udp_active_(udp_only),
+      last_receive_ms_(misc::get_time_ms()),
+      last_snapshot_sequence_(0),
+      pending_ack_sequence_(0),
+      command_send_interval_ms_(1000 / command_send_rate),
+      unsent_command_count_(0),
+      acked_command_id_(0),
       host_(host),
       port_(port),
+      room_(room),
       exit_program_(false),
       predict_and_interpolate_(true),
       debug_(false),
       interface_(interface)
   {
-    start_server_connect();
+    if (udp_only_)
+      start_udp_only();
+    else
+      start_server_connect();
+
     io_service_thread_ = std::thread([this](){ io_service_.run(); });
     INFO("client started");
   }
@@ -49,8 +73,14 @@ public:
     INFO("joining game");
 
     // wait for server to accept join request and send world snapshot
-    while (!game_ready() && !exit_program_)
+    while (!game_ready() && !exit_program_) {
+      network::frame outgoing;
+      add_snapshot_ack(outgoing);
+      send_frame(outgoing);
+      flush_reliable_messages();
+      check_udp_timeout();
       misc::sleep_ms(200);
+    }
 
     main_loop();
   }
@@ -61,6 +91,7 @@ private:
     int command_id = 1;
     uint64_t frame_time_ms = 0;
     uint64_t start_ms, stop_ms;
+    uint64_t send_ms = 0;
 
     // main loop
     while (!exit_program_) {
@@ -73,6 +104,8 @@ private:
       if (interface_.check_event_quit())
         break;
 
+      check_udp_timeout();
+
       // update debug state
       if (interface_.check_event_button_released(keyboard::button::f1)) {
         debug_ = !debug_;
@@ -106,10 +139,12 @@ private:
 
           // process command (predict)
           world_.run_command(command, player_id_);
+          record_prediction();
         }
 
-        // send command to server
-        network::write_object(command::CLASS_ID, command, socket_);
+        // send command to server with the next batch
+        recent_commands_.push_back(command);
+        unsent_command_count_++;
       }
 
       // handle entity interpolation
@@ -120,7 +155,7 @@ private:
         get_snapshots_adjacent_to_time_point(from, to, render_time);
 
         if (from && to)
-          interpolate(from, to, render_time);
+          interpolation::interpolate(world_, player_id_, from.get(), to.get(), render_time);
       }
 
       interface_.draw_clear();
@@ -137,6 +172,15 @@ private:
       commands_mutex_.unlock();
       world_mutex_.unlock();
 
+      // send commands and snapshot ack together, at the command send rate
+      if (start_ms - send_ms >= command_send_interval_ms_) {
+        network::frame outgoing;
+        add_commands(outgoing);
+        add_snapshot_ack(outgoing);
+        send_frame(outgoing);
+        send_ms = start_ms;
+      }
+
       stop_ms = misc::get_time_ms();
       frame_time_ms = MAIN_LOOP_SLEEP_MS + stop_ms - start_ms;
       game_time_ms_ += frame_time_ms;
@@ -145,21 +189,79 @@ private:
     }
   }
 
-  void process_message() {
-    switch (network::get_class_id(read_buffer_)) {
-      case network::world_snapshot::CLASS_ID:
-        process_world_update();
-        break;
-      case network::server_accept::CLASS_ID:
-        process_join_accept();
-        break;
-      case network::server_deny::CLASS_ID:
-        process_join_deny();
-        break;
+  // passes decoded messages to the process_message overloads
+  class message_handler {
+  public:
+    message_handler(client& c)
+      : client_(c)
+    {
     }
+
+    template <typename T>
+    void operator()(T& message, const network::message_body& body) {
+      client_.process_message(message, body);
+    }
+
+  private:
+    client& client_;
+  };
+
+  using message_dispatcher = network::message_dispatcher<network::server_messages,
+      message_handler>;
+
+  void process_message(const network::message_body& body) {
+    message_handler handler(*this);
+
+    if (!message_dispatcher::dispatch(body, handler))
+      DEBUG("unknown or invalid message, class id: "
+          << static_cast<int>(network::get_class_id(body)));
   }
 
-  void process_world_update() {
+  // body is kept as dictionary when compression is enabled
+  void process_message(const network::world_delta& delta, const network::message_body& body) {
+    // discard snapshots older than the last one, udp may reorder them
+    if (last_snapshot_sequence_ && !network::sequence_is_newer(delta.sequence,
+        last_snapshot_sequence_))
+      return;
+
+    // rebuild snapshot from baseline and delta
+    network::world_snapshot snapshot((world()));
+
+    if (delta.baseline_sequence) {
+      const network::world_snapshot* baseline = get_baseline_snapshot(delta.baseline_sequence);
+
+      if (!baseline) {
+        DEBUG("missing baseline: " << delta.baseline_sequence);
+        return;
+      }
+
+      snapshot = *baseline;
+    }
+
+    delta.apply(snapshot.snapshot);
+    snapshot.sequence = delta.sequence;
+    snapshot.server_time_ms = delta.server_time_ms;
+
+    // keep snapshot as baseline and acknowledge it
+    baseline_snapshots_.push_back(snapshot);
+    if (baseline_snapshots_.size() > network::SNAPSHOT_HISTORY_SIZE)
+      baseline_snapshots_.pop_front();
+
+#if _COMPRESSION
+    baseline_bodies_.push_back(std::vector<uint8_t>(body.data, body.data + body.size));
+    if (baseline_bodies_.size() > network::SNAPSHOT_HISTORY_SIZE)
+      baseline_bodies_.pop_front();
+#endif
+
+    last_snapshot_sequence_ = delta.sequence;
+
+    // acknowledged with the next frame sent by the main loop
+    pending_ack_sequence_ = delta.sequence;
+
+    boost::optional<player&> p = snapshot.snapshot.get_player(player_id_);
+    if (p)
+      acked_command_id_ = p.get().get_last_command_id();
+
     world_mutex_.lock();
 
     // decide if to create new snapshot or overwrite last
@@ -167,11 +269,12 @@ private:
       world_snapshots_.emplace_back(world()); // create new
 
     // put snapshot last
-    network::deserialize(world_snapshots_.back(), read_buffer_);
+    world_snapshots_.back() = snapshot;
     world_snapshots_.back().client_time_ms = game_time_ms_;
 
     // clean up
-    remove_old_world_snapshots();
+    interpolation::remove_old_world_snapshots(world_snapshots_, get_interpolation_time_point_ms(),
+        INTERPOLATION_TIME_MS);
 
     // update world
     world_ = world(world_snapshots_.back().snapshot);
@@ -196,29 +299,87 @@ private:
           i++;
       }
 
-      //
-      // TODO: correct player position and clear commands, if needed
-      //
+      // the server simulates at full precision like the prediction, the snapshot only has the
+      // state snapped to the wire. if the prediction of the last command the server ran snaps
+      // to the same values, both computed the same state and the prediction is kept, so a
+      // snapshot corrects the player only when they really differ.
+      while (predicted_players_.size()
+          && predicted_players_.front().get_last_command_id() < last_command_id)
+        predicted_players_.pop_front();
+
+      if (predicted_players_.size()
+          && predicted_players_.front().get_last_command_id() == last_command_id
+          && !network::player_delta(boost::optional<const player&>(predicted_players_.front()),
+              p.get()).fields)
+        p.get() = predicted_players_.front();
+
+      predicted_players_.clear();
 
       // run remaining commands in updated world
-      for (auto& c : commands_)
+      for (auto& c : commands_) {
         world_.run_command(c, player_id_);
+        record_prediction();
+      }
 
       commands_mutex_.unlock();
       world_mutex_.unlock();
     }
   }
 
-  void process_join_accept() {
-    network::server_accept m;
-    network::deserialize(m, read_buffer_);
+  // keeps the own player after the command just predicted, with world and commands locked
+  void record_prediction() {
+    boost::optional<player&> p = world_.get_player(player_id_);
+
+    if (p)
+      predicted_players_.push_back(p.get());
+  }
+
+  const network::world_snapshot* get_baseline_snapshot(uint32_t sequence) {
+    for (auto& s : baseline_snapshots_)
+      if (s.sequence == sequence)
+        return &s;
+
+    return nullptr;
+  }
+
+#if _COMPRESSION
+  void process_message(const network::compressed_message& m,
+      const network::message_body& body) {
+    uint64_t start_us = misc::get_time_us();
+
+    // dictionary is the body of a baseline snapshot
+    const std::vector<uint8_t>* dictionary = nullptr;
+
+    for (size_t i = 0; i < baseline_snapshots_.size() && m.dictionary_sequence; i++)
+      if (baseline_snapshots_[i].sequence == m.dictionary_sequence)
+        dictionary = &baseline_bodies_[i];
+
+    if (m.dictionary_sequence && !dictionary) {
+      DEBUG("missing dictionary: " << m.dictionary_sequence);
+      return;
+    }
+
+    if (!decompressor_.decompress(m.data.data(), m.data.size(),
+        dictionary ? dictionary->data() : nullptr, dictionary ? dictionary->size() : 0, m.size,
+        decompressed_body_)) {
+      DEBUG("invalid compressed message");
+      return;
+    }
+
+    DEBUG("decompressed " << std::dec << body.size << " -> " << m.size << " bytes, "
+        << misc::get_time_us() - start_us << " us");
+
+    process_message(decompressed_body_);
+  }
+
+#endif
+  void process_message(const network::server_accept& m, const network::message_body& body) {
+    udp_token_ = m.udp_token;
     player_id_ = m.player_id;
     INFO("joined game, player_id: " << std::to_string(player_id_));
   }
 
-  void process_join_deny() {
-    network::server_deny m;
-    network::deserialize(m, read_buffer_);
+  void process_message(const network::server_deny& m, const network::message_body& body) {
     INFO("join rejected, reason: " << m.reason);
     signal_exit();
   }
@@ -226,8 +387,17 @@ private:
   void make_join_request() {
     network::join_request m;
     m.player_color_AABBGGRR = misc::generate_color_AABBGGRR();
+    m.room = room_;
     DEBUG("player color: " << std::hex << std::setfill('0') << m.player_color_AABBGGRR);
-    network::write_object(network::join_request::CLASS_ID, m, socket_);
+
+    if (udp_only_) {
+      std::lock_guard<std::mutex> lock(channel_mutex_);
+      network::write_reliable(m, channel_);
+      network::write_packet(network::frame(), 0, channel_, udp_socket_, udp_endpoint_);
+    } else {
+      network::write_object(m, *write_queue_);
+    }
+
     INFO("join request sent");
   }
 
@@ -270,57 +440,172 @@ private:
     }
   }
 
-  void interpolate(boost::optional<network::world_snapshot&>& from,
-      boost::optional<network::world_snapshot&>& to, uint64_t time_point) {
-    //
-    // TODO: put interpolation code in class world and player
-    //
-
-    // get interpolation time fraction
-    double fraction = get_time_fraction(from.get().client_time_ms,
-        to.get().client_time_ms, time_point);
-
-    for (player& p_from : from.get().snapshot.get_players()) {
-      for (player& p_to : to.get().snapshot.get_players()) {
-        // player exists in both snapshots and is not client player, interpolate
-        if (p_from.get_id() == p_to.get_id() && p_to.get_id() != player_id_) {
-          // get player from world that will be rendered
-          boost::optional<player&> p_real = world_.get_player(p_to.get_id());
-          if (p_real) {
-            // calc interpolated player values
-            double new_x = (p_to.get_x() - p_from.get_x()) * fraction + p_from.get_x();
-            double new_y = (p_to.get_y() - p_from.get_y()) * fraction + p_from.get_y();
-            double new_z = (p_to.get_z() - p_from.get_z()) * fraction + p_from.get_z();
-            double new_angel = (p_to.get_horz_angel() - p_from.get_horz_angel())
-                * fraction + p_from.get_horz_angel();
-
-            // assign values to player
-            p_real.get().set_x(new_x);
-            p_real.get().set_y(new_y);
-            p_real.get().set_z(new_z);
-            p_real.get().set_horz_angel(new_angel);
-          }
-        }
-      }
+  // adds commands not sent yet, and over udp a few sent ones the server may not have received
+  void add_commands(network::frame& outgoing) {
+    if (!unsent_command_count_)
+      return;
+
+    // oldest commands are dropped if the main loop ran far more often than the send rate
+    const size_t max_commands = network::command_batch::MAX_COMMANDS;
+    unsent_command_count_ = std::min(unsent_command_count_, max_commands);
+
+    // repeated commands only fill up the batch, it never holds more than MAX_COMMANDS
+    size_t max_redundant = udp_active_ ? max_commands - unsent_command_count_ : 0;
+    if (max_redundant > REDUNDANT_COMMANDS)
+      max_redundant = REDUNDANT_COMMANDS;
+
+    size_t redundant = 0;
+    for (auto i = recent_commands_.rbegin() + unsent_command_count_; redundant < max_redundant
+        && i != recent_commands_.rend() && i->id > acked_command_id_; i++)
+      redundant++;
+
+    network::command_batch m;
+    m.commands.assign(recent_commands_.end() - unsent_command_count_ - redundant,
+        recent_commands_.end());
+    outgoing.add(network::make_message(m));
+
+    // keep the commands that may be repeated in the next batch
+    while (recent_commands_.size() > REDUNDANT_COMMANDS)
+      recent_commands_.pop_front();
+
+    unsent_command_count_ = 0;
+  }
+
+  void add_snapshot_ack(network::frame& outgoing) {
+    network::snapshot_ack ack;
+    ack.sequence = pending_ack_sequence_.exchange(0);
+
+    if (ack.sequence)
+      outgoing.add(network::make_message(ack));
+  }
+
+  // sends snapshot acks and commands over udp once the server has answered on udp, otherwise
+  // over tcp with a copy over udp to open the channel (server skips the duplicates)
+  void send_frame(const network::frame& outgoing) {
+    if (outgoing.empty())
+      return;
+
+    if (!udp_active_)
+      network::write_frame(outgoing, *write_queue_);
+
+    if ((!udp_token_ && !udp_only_) || !udp_socket_.is_open())
+      return;
+
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    network::write_packet(outgoing, udp_only_ ? 0 : udp_token_.load(), channel_, udp_socket_,
+        udp_endpoint_);
+  }
+
+  // sends a packet without unreliable message if reliable messages are waiting
+  void flush_reliable_messages() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+
+    if (udp_socket_.is_open() && channel_.has_messages_to_send(misc::get_time_ms()))
+      network::write_packet(network::frame(), udp_only_ ? 0 : udp_token_.load(),
+          channel_, udp_socket_, udp_endpoint_);
+  }
+
+  void check_udp_timeout() {
+    if (udp_only_ && misc::get_time_ms() - last_receive_ms_ > network::CONNECTION_TIMEOUT_MS) {
+      INFO("server not responding");
+      signal_exit();
+    }
+  }
+
+  void start_udp_receive() {
+    udp_socket_.async_receive(boost::asio::buffer(udp_read_buffer_),
+        boost::bind(&client::handle_udp_receive, this,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred));
+  }
+
+  void handle_udp_receive(const boost::system::error_code& error, size_t size) {
+    if (error) {
+      DEBUG("async_receive(): " << error.message());
+
+      if (error == boost::asio::error::operation_aborted)
+        return;
+    } else {
+      process_datagram(size);
+    }
+
+    start_udp_receive();
+  }
+
+  void process_datagram(size_t size) {
+    network::packet_header header;
+    if (!header.read(udp_read_buffer_.data(), size))
+      return;
+
+    last_receive_ms_ = misc::get_time_ms();
+    udp_active_ = true;
+
+    std::vector<std::vector<uint8_t>> messages;
+    size_t body_pos;
+
+    {
+      std::lock_guard<std::mutex> lock(channel_mutex_);
+      body_pos = channel_.read_packet(header, udp_read_buffer_.data(), size, last_receive_ms_,
+          messages);
     }
+
+    // handle reliable messages, then unreliable messages unless packet is stale
+    for (auto& m : messages)
+      process_message(m);
+
+    if (body_pos)
+      network::read_messages(udp_read_buffer_.data() + body_pos, size - body_pos,
+          [this](const network::message_body& body) { process_message(body); });
   }
 
-  double get_time_fraction(uint64_t start_ms, uint64_t stop_ms, uint64_t between_ms) {
-    return static_cast<double>(between_ms - start_ms) / static_cast<double>(stop_ms - start_ms);
+  // joins over udp without a tcp connection
+  void start_udp_only() {
+    // use first ipv4 address of host, like the server listens on
+    boost::asio::ip::tcp::endpoint endpoint = *endpoint_iterator_;
+
+    for (auto i = endpoint_iterator_; i != boost::asio::ip::tcp::resolver::iterator(); i++) {
+      if (i->endpoint().address().is_v4()) {
+        endpoint = *i;
+        break;
+      }
+    }
+
+    udp_endpoint_ = boost::asio::ip::udp::endpoint(endpoint.address(), endpoint.port());
+
+    boost::system::error_code error;
+    udp_socket_.open(udp_endpoint_.protocol(), error);
+
+    if (!error)
+      udp_socket_.connect(udp_endpoint_, error);
+
+    if (error) {
+      signal_exit();
+      INFO("error, could not open udp socket: " << error.message());
+      return;
+    }
+
+    INFO("using udp only");
+    start_udp_receive();
+    make_join_request();
   }
 
-  void remove_old_world_snapshots() {
-    bool remove_next = false;
-    uint64_t render_time = get_interpolation_time_point_ms();
-    auto i = world_snapshots_.end();
+  void start_udp_channel() {
+    boost::system::error_code error;
+    udp_endpoint_ = boost::asio::ip::udp::endpoint(
+        socket_.remote_endpoint(error).address(), socket_.remote_endpoint(error).port());
+
+    if (!error)
+      udp_socket_.open(udp_endpoint_.protocol(), error);
 
-    while (i != world_snapshots_.begin()) {
-      if (remove_next)
-        i = world_snapshots_.erase(i);
-      else if (i->client_time_ms <= render_time && i->client_time_ms > INTERPOLATION_TIME_MS)
-        remove_next = true;
-      i--;
+    if (!error)
+      udp_socket_.connect(udp_endpoint_, error);
+
+    if (error) {
+      INFO("udp channel not available: " << error.message());
+      return;
     }
+
+    start_udp_receive();
   }
 
   void start_server_connect() {
@@ -331,74 +616,91 @@ private:
   void handle_server_connect(const boost::system::error_code& error) {
     if (!error) {
       INFO("connected to server");
+      start_udp_channel();
       make_join_request();
-      start_read_header();
+      start_read();
     } else {
       signal_exit();
       DEBUG("async_connect(): " << error.message());
     }
   }
 
-  void start_read_header() {
-    read_buffer_.clear();
-    read_buffer_.resize(network::HEADER_SIZE);
-
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_buffer_, network::HEADER_SIZE),
-        boost::bind(&client::handle_read_header, this, boost::asio::placeholders::error));
+  void start_read() {
+    socket_.async_read_some(reader_.prepare(),
+        boost::bind(&client::handle_read, this,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred));
   }
 
-  void handle_read_header(const boost::system::error_code& error) {
+  void handle_read(const boost::system::error_code& error, size_t size) {
     if (!error) {
-      start_read_body(network::get_body_size(read_buffer_));
-    } else {
-      signal_exit();
-      DEBUG("async_read(): " << error.message());
-    }
-  }
-
-  void start_read_body(size_t body_size) {
-    read_buffer_.clear();
-    read_buffer_.resize(body_size);
-
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_buffer_, body_size),
-        boost::bind(&client::handle_read_body, this, boost::asio::placeholders::error));
-  }
+      // handle every complete message received
+      reader_.commit(size);
+      bool valid = network::read_messages(reader_,
+          [this](const network::message_body& body) { process_message(body); });
+
+      if (!valid) {
+        INFO("error, message from server too large");
+        signal_exit();
+        return;
+      }
 
-  void handle_read_body(const boost::system::error_code& error) {
-    if (!error) {
-      process_message();
-      start_read_header();
+      start_read();
     } else {
       signal_exit();
-      DEBUG("async_read(): " << error.message());
+      DEBUG("async_read_some(): " << error.message());
     }
   }
 
   void signal_exit() {
     socket_.close();
+    udp_socket_.close();
     exit_program_ = true;
   }
 
   // game
   world world_;
   std::list<network::world_snapshot> world_snapshots_;
+  std::deque<network::world_snapshot> baseline_snapshots_; // only used by io thread
+#if _COMPRESSION
+  std::deque<std::vector<uint8_t>> baseline_bodies_; // messages of baseline_snapshots_
+  network::decompressor decompressor_;
+  std::vector<uint8_t> decompressed_body_;
+#endif
   std::mutex world_mutex_;
   std::list<command> commands_;
+  std::deque<player> predicted_players_; // own player after each command in commands_
   std::mutex commands_mutex_;
-  std::atomic<uint8_t> player_id_;
+  std::atomic<uint16_t> player_id_;
   std::atomic<uint64_t> game_time_ms_;
 
   // network
-  std::vector<uint8_t> read_buffer_;
+  network::stream_reader reader_;
   boost::asio::io_service io_service_;
+  boost::asio::io_service::strand write_strand_; // messages are pushed from the ui thread
   boost::asio::ip::tcp::socket socket_;
+  network::outbound_queue_ptr write_queue_;
   boost::asio::ip::tcp::resolver resolver_;
   boost::asio::ip::tcp::resolver::iterator endpoint_iterator_;
+  boost::asio::ip::udp::socket udp_socket_;
+  boost::asio::ip::udp::endpoint udp_endpoint_;
+  std::array<uint8_t, 65536> udp_read_buffer_;
+  std::atomic<uint32_t> udp_token_;
+  bool udp_only_;
+  std::atomic<bool> udp_active_; // server has sent snapshots over udp
+  std::atomic<uint64_t> last_receive_ms_;
+  network::reliable_channel channel_;
+  std::mutex channel_mutex_;
+  uint32_t last_snapshot_sequence_;
+  std::atomic<uint32_t> pending_ack_sequence_; // 0 if nothing to acknowledge
+  uint64_t command_send_interval_ms_;
+  std::deque<command> recent_commands_; // only used by main thread
+  size_t unsent_command_count_; // at the end of recent_commands_
+  std::atomic<int> acked_command_id_; // last command applied in a received snapshot
   std::thread io_service_thread_;
   std::string host_;
   std::string port_;
+  uint32_t room_; // world instance joined on the server
 
   // other
   std::atomic<bool> exit_program_;
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <boost/serialization/access.hpp>
+#include "binary_archive.hpp"
 
 class command {
 public:
@@ -14,6 +15,10 @@ public:
   float vert_delta_angel;
   int duration_ms; // frame time
 
+  // bytes, binary archive, fields as in serialize
+  static const size_t MAX_SIZE = network::archived_size<decltype(id), decltype(buttons),
+      decltype(horz_delta_angel), decltype(vert_delta_angel), decltype(duration_ms)>();
+
 private:
   friend class boost::serialization::access;
 
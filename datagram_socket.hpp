@@ -0,0 +1,395 @@
+#ifndef DATAGRAM_SOCKET_HPP_
+#define DATAGRAM_SOCKET_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <boost/asio.hpp>
+#include "frame.hpp"
+#include "message_buffer.hpp"
+#include "misc.hpp"
+
+namespace network {
+  // system calls of a udp socket and the datagrams they moved, since the socket was opened
+  struct datagram_stats {
+    uint64_t send_calls;
+    uint64_t datagrams_sent;
+    uint64_t receive_calls;
+    uint64_t datagrams_received;
+  };
+
+  // datagram_stats counted from any thread
+  class datagram_counters {
+  public:
+    datagram_counters()
+      : send_calls_(0),
+        datagrams_sent_(0),
+        receive_calls_(0),
+        datagrams_received_(0)
+    {
+    }
+
+    void count_send(uint64_t datagrams) {
+      send_calls_++;
+      datagrams_sent_ += datagrams;
+    }
+
+    void count_receive(uint64_t datagrams) {
+      receive_calls_++;
+      datagrams_received_ += datagrams;
+    }
+
+    datagram_stats get() const {
+      return { send_calls_, datagrams_sent_, receive_calls_, datagrams_received_ };
+    }
+
+  private:
+    std::atomic<uint64_t> send_calls_;
+    std::atomic<uint64_t> datagrams_sent_;
+    std::atomic<uint64_t> receive_calls_;
+    std::atomic<uint64_t> datagrams_received_;
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // Udp socket of the server on the boost asio reactor. Sends are queued until flush, which hands
+  // them to the kernel with sendmmsg, so a snapshot round to every client costs a call per batch
+  // instead of one per client. Queued packets only reference their message buffers, which the
+  // kernel gathers from directly. Where the kernel offers segmentation offload (GSO), consecutive
+  // datagrams of equal size to one client go out as one message. When the socket is readable,
+  // datagrams are drained on a strand with recvmmsg, split again if the kernel coalesced them
+  // (GRO).
+  //
+
+  class asio_socket {
+  public:
+    static const size_t BATCH_SIZE = 64; // messages per sendmmsg or recvmmsg call
+    static const size_t RECEIVE_BUFFER_SIZE = 65536; // bytes, one datagram or a coalesced run
+    static const int MAX_RECEIVE_BATCHES = 4; // per wakeup, then other handlers get a turn
+    static const size_t MAX_SEGMENTS = 64; // datagrams per segmented message
+    static const size_t MAX_SEGMENTED_SIZE = 65000; // bytes, below the ip packet limit
+    static const size_t MAX_IOVECS = 1024; // per message, UIO_MAXIOV
+
+    asio_socket(boost::asio::io_service& io_service, const boost::asio::ip::udp::endpoint& endpoint)
+      : socket_(io_service, endpoint),
+        gso_(false),
+        gro_(false),
+        cancelled_(false),
+        send_messages_(BATCH_SIZE),
+        datagram_counts_(BATCH_SIZE),
+        send_controls_(BATCH_SIZE),
+        receive_buffers_(BATCH_SIZE * RECEIVE_BUFFER_SIZE),
+        receive_messages_(BATCH_SIZE),
+        receive_iovecs_(BATCH_SIZE),
+        receive_addresses_(BATCH_SIZE),
+        receive_controls_(BATCH_SIZE)
+    {
+      int fd = socket_.native_handle();
+      int on = 1;
+      int segment_size = 0; // set per message, here it only probes for support
+
+      gso_ = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+      gro_ = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+      INFO("udp socket, segmentation offload: " << gso_ << ", receive offload: " << gro_);
+    }
+
+    asio_socket(const asio_socket&) = delete;
+    asio_socket& operator=(const asio_socket&) = delete;
+
+    // queues a datagram of header followed by the messages of data until the next flush
+    void send_to(const message_buffer& header, const frame& data,
+        const boost::asio::ip::udp::endpoint& endpoint) {
+      const std::vector<message_buffer>& messages = data.get_messages();
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back({ queued_buffers_.size(), 1 + messages.size(),
+          header->data.size() + data.size(), endpoint });
+      queued_buffers_.push_back(header);
+      queued_buffers_.insert(queued_buffers_.end(), messages.begin(), messages.end());
+    }
+
+    // sends every queued datagram, a batch per system call
+    void flush() {
+      std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sending_.swap(queue_);
+        sending_buffers_.swap(queued_buffers_);
+      }
+
+      send_iovecs_.resize(sending_buffers_.size());
+
+      for (size_t i = 0; i < sending_buffers_.size(); i++) {
+        send_iovecs_[i].iov_base = const_cast<uint8_t*>(sending_buffers_[i]->data.data());
+        send_iovecs_[i].iov_len = sending_buffers_[i]->data.size();
+      }
+
+      for (size_t next = 0; next < sending_.size();)
+        next = send_batch(next);
+
+      sending_.clear();
+      sending_buffers_.clear();
+    }
+
+    // handler(const uint8_t* data, size_t size, const udp::endpoint& sender) is called on strand
+    // for every datagram, data is only valid during the call
+    template <typename Handler>
+    void start_receive(boost::asio::io_service::strand& strand, Handler handler) {
+      socket_.async_wait(boost::asio::ip::udp::socket::wait_read,
+          strand.wrap([this, &strand, handler](const boost::system::error_code& error) {
+            if (cancelled_)
+              return;
+
+            if (error) {
+              DEBUG("async_wait(): " << error.message());
+
+              if (error == boost::asio::error::operation_aborted)
+                return;
+            } else {
+              receive(handler);
+            }
+
+            start_receive(strand, handler);
+          }));
+    }
+
+    // stops receiving, also if the wait has already completed, on the receive strand or with
+    // no thread running it
+    void cancel() {
+      boost::system::error_code error;
+      cancelled_ = true;
+      socket_.cancel(error);
+    }
+
+    datagram_stats get_stats() const {
+      return counters_.get();
+    }
+
+  private:
+    // buffers of a datagram are consecutive, so are those of consecutive datagrams
+    struct queued_datagram {
+      size_t first_buffer;
+      size_t buffer_count;
+      size_t size; // bytes
+      boost::asio::ip::udp::endpoint endpoint;
+    };
+
+    struct control_buffer {
+      alignas(cmsghdr) uint8_t data[CMSG_SPACE(sizeof(int))];
+    };
+
+    // sends datagrams from first on in one sendmmsg call, returns the next datagram to send
+    size_t send_batch(size_t first) {
+      size_t count = 0;
+      size_t next = first;
+
+      while (count < BATCH_SIZE && next < sending_.size()) {
+        size_t segments = get_segment_count(next);
+        queued_datagram& d = sending_[next];
+        const queued_datagram& last = sending_[next + segments - 1];
+
+        mmsghdr& m = send_messages_[count];
+        std::memset(&m, 0, sizeof(m));
+        m.msg_hdr.msg_name = d.endpoint.data();
+        m.msg_hdr.msg_namelen = d.endpoint.size();
+        m.msg_hdr.msg_iov = &send_iovecs_[d.first_buffer];
+        m.msg_hdr.msg_iovlen = last.first_buffer + last.buffer_count - d.first_buffer;
+
+        // the kernel cuts the message into datagrams of the size of the first one
+        if (segments > 1) {
+          m.msg_hdr.msg_control = send_controls_[count].data;
+          m.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+          cmsghdr* c = CMSG_FIRSTHDR(&m.msg_hdr);
+          c->cmsg_level = SOL_UDP;
+          c->cmsg_type = UDP_SEGMENT;
+          c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+          uint16_t segment_size = d.size;
+          std::memcpy(CMSG_DATA(c), &segment_size, sizeof(segment_size));
+        }
+
+        datagram_counts_[count] = segments;
+        count++;
+        next += segments;
+      }
+
+      for (size_t sent = 0; sent < count;) {
+        int result = sendmmsg(socket_.native_handle(), &send_messages_[sent], count - sent, 0);
+
+        if (result >= 0) {
+          uint64_t datagrams = 0;
+
+          for (size_t i = sent; i < sent + result; i++)
+            datagrams += datagram_counts_[i];
+
+          counters_.count_send(datagrams);
+          sent += result;
+        } else if (errno != EINTR) {
+          counters_.count_send(0);
+          DEBUG("sendmmsg(): " << std::strerror(errno));
+
+          // devices without checksum offload refuse segmented messages
+          if (send_messages_[sent].msg_hdr.msg_controllen && gso_) {
+            INFO("segmentation offload failed, sending datagrams one by one");
+            gso_ = false;
+          }
+
+          sent++; // the datagrams of the failed message are lost
+        }
+      }
+
+      return next;
+    }
+
+    // datagrams from first on that can go out as one message, all of the size of the first but
+    // the last, which may be shorter, to the same endpoint
+    size_t get_segment_count(size_t first) const {
+      if (!gso_)
+        return 1;
+
+      const queued_datagram& d = sending_[first];
+      size_t segment_size = d.size;
+      size_t total_size = segment_size;
+      size_t buffers = d.buffer_count;
+      size_t count = 1;
+
+      while (count < MAX_SEGMENTS && first + count < sending_.size()) {
+        const queued_datagram& next = sending_[first + count];
+        size_t size = next.size;
+
+        if (next.endpoint != d.endpoint || !size || size > segment_size
+            || total_size + size > MAX_SEGMENTED_SIZE || buffers + next.buffer_count > MAX_IOVECS)
+          break;
+
+        count++;
+        total_size += size;
+        buffers += next.buffer_count;
+
+        if (size < segment_size)
+          break;
+      }
+
+      return count;
+    }
+
+    // drains datagrams waiting in the socket, on the receive strand
+    template <typename Handler>
+    void receive(const Handler& handler) {
+      for (int batch = 0; batch < MAX_RECEIVE_BATCHES; batch++) {
+        for (size_t i = 0; i < BATCH_SIZE; i++) {
+          receive_iovecs_[i].iov_base = &receive_buffers_[i * RECEIVE_BUFFER_SIZE];
+          receive_iovecs_[i].iov_len = RECEIVE_BUFFER_SIZE;
+
+          mmsghdr& m = receive_messages_[i];
+          std::memset(&m, 0, sizeof(m));
+          m.msg_hdr.msg_name = &receive_addresses_[i];
+          m.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+          m.msg_hdr.msg_iov = &receive_iovecs_[i];
+          m.msg_hdr.msg_iovlen = 1;
+          m.msg_hdr.msg_control = receive_controls_[i].data;
+          m.msg_hdr.msg_controllen = sizeof(receive_controls_[i].data);
+        }
+
+        int count = recvmmsg(socket_.native_handle(), receive_messages_.data(), BATCH_SIZE,
+            MSG_DONTWAIT, nullptr);
+
+        if (count < 0) {
+          counters_.count_receive(0);
+
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            DEBUG("recvmmsg(): " << std::strerror(errno));
+
+          return;
+        }
+
+        uint64_t datagrams = 0;
+
+        for (int i = 0; i < count; i++)
+          datagrams += handle_message(i, handler);
+
+        counters_.count_receive(datagrams);
+
+        if (static_cast<size_t>(count) < BATCH_SIZE)
+          return;
+      }
+    }
+
+    // passes the datagrams of a received message to handler, returns their number
+    template <typename Handler>
+    size_t handle_message(int index, const Handler& handler) {
+      const msghdr& m = receive_messages_[index].msg_hdr;
+      size_t size = receive_messages_[index].msg_len;
+      const uint8_t* data = &receive_buffers_[index * RECEIVE_BUFFER_SIZE];
+
+      if (m.msg_flags & MSG_TRUNC) {
+        DEBUG("datagram dropped, larger than receive buffer");
+        return 0;
+      }
+
+      boost::asio::ip::udp::endpoint sender;
+      std::memcpy(sender.data(), &receive_addresses_[index], m.msg_namelen);
+      sender.resize(m.msg_namelen);
+
+      size_t segment_size = size;
+
+      if (gro_) {
+        for (const cmsghdr* c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(const_cast<msghdr*>(&m),
+            const_cast<cmsghdr*>(c))) {
+          if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+            int gro_size;
+            std::memcpy(&gro_size, CMSG_DATA(c), sizeof(gro_size));
+
+            if (gro_size > 0)
+              segment_size = gro_size;
+          }
+        }
+      }
+
+      size_t datagrams = 0;
+
+      for (size_t pos = 0; pos < size || !datagrams; pos += segment_size) {
+        handler(data + pos, std::min(segment_size, size - pos), sender);
+        datagrams++;
+      }
+
+      return datagrams;
+    }
+
+    boost::asio::ip::udp::socket socket_;
+    bool gso_;
+    bool gro_;
+    bool cancelled_; // receiving stopped
+    datagram_counters counters_;
+
+    // sending, queue_ is guarded by mutex_ since any strand may send, the rest by flush_mutex_
+    std::mutex mutex_;
+    std::vector<queued_datagram> queue_;
+    std::vector<message_buffer> queued_buffers_;
+    std::mutex flush_mutex_;
+    std::vector<queued_datagram> sending_;
+    std::vector<message_buffer> sending_buffers_;
+    std::vector<iovec> send_iovecs_; // by buffer in sending_buffers_
+    std::vector<mmsghdr> send_messages_;
+    std::vector<size_t> datagram_counts_; // by message in send_messages_
+    std::vector<control_buffer> send_controls_;
+
+    // receiving, only used on the receive strand
+    std::vector<uint8_t> receive_buffers_;
+    std::vector<mmsghdr> receive_messages_;
+    std::vector<iovec> receive_iovecs_;
+    std::vector<sockaddr_storage> receive_addresses_;
+    std::vector<control_buffer> receive_controls_;
+  };
+}
+
+#endif // DATAGRAM_SOCKET_HPP_
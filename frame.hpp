@@ -0,0 +1,58 @@
+#ifndef FRAME_HPP_
+#define FRAME_HPP_
+
+#include <cstdint>
+#include <vector>
+#include <boost/asio.hpp>
+#include "message_buffer.hpp"
+
+namespace network {
+  //
+  // Messages that go out in one write or one datagram. Each message keeps its own header, so
+  // the receiver splits them the same way as a tcp stream. Built messages are only referenced,
+  // the write gathers them straight from their buffers.
+  //
+
+  class frame {
+  public:
+    frame()
+      : size_(0)
+    {
+    }
+
+    void add(const message_buffer& message) {
+      messages_.push_back(message);
+      size_ += message->data.size();
+    }
+
+    bool empty() const {
+      return messages_.empty();
+    }
+
+    // bytes of all messages, headers included
+    size_t size() const {
+      return size_;
+    }
+
+    void clear() {
+      messages_.clear();
+      size_ = 0;
+    }
+
+    const std::vector<message_buffer>& get_messages() const {
+      return messages_;
+    }
+
+    // appends one buffer per message, valid as long as the frame is
+    void get_buffers(std::vector<boost::asio::const_buffer>& buffers) const {
+      for (auto& m : messages_)
+        buffers.push_back(boost::asio::buffer(m->data));
+    }
+
+  private:
+    std::vector<message_buffer> messages_;
+    size_t size_;
+  };
+}
+
+#endif // FRAME_HPP_
@@ -0,0 +1,68 @@
+#ifndef INTERPOLATION_HPP_
+#define INTERPOLATION_HPP_
+
+#include <cstdint>
+#include <list>
+#include <boost/optional.hpp>
+#include "network.hpp"
+#include "player.hpp"
+#include "quantization.hpp"
+#include "world.hpp"
+
+// entity interpolation of the client, smoothing other players between received snapshots
+namespace interpolation {
+  double get_time_fraction(uint64_t start_ms, uint64_t stop_ms, uint64_t between_ms) {
+    return static_cast<double>(between_ms - start_ms) / static_cast<double>(stop_ms - start_ms);
+  }
+
+  // moves the players of w that are in both snapshots, except player_id, to where they were at
+  // time_point, a client time between the snapshots
+  void interpolate(world& w, uint16_t player_id, const network::world_snapshot& from,
+      const network::world_snapshot& to, uint64_t time_point) {
+    double fraction = get_time_fraction(from.client_time_ms, to.client_time_ms, time_point);
+
+    for (const player& p_to : to.snapshot.get_players()) {
+      boost::optional<const player&> opt_from = from.snapshot.get_player(p_to.get_id());
+
+      // player exists in both snapshots and is not client player, interpolate
+      if (opt_from && p_to.get_id() != player_id) {
+        const player& p_from = opt_from.get();
+
+        // get player from world that will be rendered
+        boost::optional<player&> p_real = w.get_player(p_to.get_id());
+        if (p_real) {
+          // calc interpolated player values
+          double new_x = (p_to.get_x() - p_from.get_x()) * fraction + p_from.get_x();
+          double new_y = (p_to.get_y() - p_from.get_y()) * fraction + p_from.get_y();
+          double new_z = (p_to.get_z() - p_from.get_z()) * fraction + p_from.get_z();
+          double new_angel = quantization::angel_difference(p_from.get_horz_angel(),
+              p_to.get_horz_angel()) * fraction + p_from.get_horz_angel();
+
+          // assign values to player
+          p_real.get().set_x(new_x);
+          p_real.get().set_y(new_y);
+          p_real.get().set_z(new_z);
+          p_real.get().set_horz_angel(new_angel);
+        }
+      }
+    }
+  }
+
+  // drops snapshots before the newest one at or before render_time, they are not interpolated
+  // from anymore. snapshots are in client time order.
+  void remove_old_world_snapshots(std::list<network::world_snapshot>& snapshots,
+      uint64_t render_time, uint64_t interpolation_time_ms) {
+    auto i = snapshots.end();
+
+    while (i != snapshots.begin()) {
+      i--;
+
+      if (i->client_time_ms <= render_time && i->client_time_ms > interpolation_time_ms) {
+        snapshots.erase(snapshots.begin(), i);
+        return;
+      }
+    }
+  }
+}
+
+#endif // INTERPOLATION_HPP_
@@ -0,0 +1,56 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include "loadgen.hpp"
+#include "misc.hpp"
+
+int main(int argc, char const *argv[]) {
+  bool valid = argc >= 4 && argc <= 8 && misc::is_number(argv[2]) && misc::is_number(argv[3])
+      && (argc < 5 || misc::is_number(argv[4]))
+      && (argc < 6 || !strcmp(argv[5], "tcp") || !strcmp(argv[5], "udp"))
+      && (argc < 7 || !strcmp(argv[6], "random") || !strcmp(argv[6], "script"))
+      && (argc < 8 || (misc::is_number(argv[7]) && std::stoul(argv[7]) > 0));
+
+  if (!valid) {
+    std::cout << "Usage: " << argv[0]
+        << " <host> <port> <bots> [seconds] [tcp|udp] [random|script] [rooms]" << std::endl
+        << std::endl;
+    std::cout << "seconds: run time, 30 by default" << std::endl;
+    std::cout << "udp: bots connect over udp only, tcp by default" << std::endl;
+    std::cout << "random: bots move and turn at random, script: every bot walks a square"
+        << std::endl;
+    std::cout << "rooms: bots are spread over rooms 0 to rooms - 1, 1 by default" << std::endl;
+
+    return 1;
+  }
+
+  loadgen_config config;
+  config.host = argv[1];
+  config.port = argv[2];
+  config.bots = std::stoul(argv[3]);
+
+  if (argc > 4)
+    config.seconds = std::stoi(argv[4]);
+  if (argc > 5)
+    config.udp_only = !strcmp(argv[5], "udp");
+  if (argc > 6 && !strcmp(argv[6], "script"))
+    config.pattern = loadgen_config::SCRIPT;
+  if (argc > 7)
+    config.rooms = std::stoul(argv[7]);
+
+  // a socket or two per bot
+  rlimit files;
+  if (!getrlimit(RLIMIT_NOFILE, &files)) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  try {
+    return loadgen(config).run() ? 0 : 3;
+  } catch (std::exception& e) {
+    std::cerr << "exception: " << e.what() << std::endl;
+
+    return 2;
+  }
+}
@@ -0,0 +1,626 @@
+#ifndef LOADGEN_HPP_
+#define LOADGEN_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/optional.hpp>
+#include "command.hpp"
+#include "keyboard.hpp"
+#include "misc.hpp"
+#include "network.hpp"
+#include "player.hpp"
+#include "world.hpp"
+
+struct loadgen_config {
+  enum pattern_type {
+    RANDOM, // buttons and turning change at random times
+    SCRIPT // the same square walk for every bot
+  };
+
+  std::string host;
+  std::string port;
+  size_t bots;
+  int seconds; // run time once the first bot is started
+  bool udp_only; // bots join over udp only, otherwise everything goes over tcp
+  pattern_type pattern;
+  uint32_t rooms; // bot i joins room i % rooms
+  int command_send_rate; // batches per second, like the client
+  int start_rate; // bots started per second, so joins do not arrive at once
+
+  loadgen_config()
+    : bots(100),
+      seconds(30),
+      udp_only(false),
+      pattern(RANDOM),
+      rooms(1),
+      command_send_rate(20),
+      start_rate(500)
+  {
+  }
+};
+
+// measurements of all bots, only used on the io thread
+struct loadgen_stats {
+  size_t joined;
+  size_t denied;
+  uint64_t snapshots;
+  uint64_t missing_baselines;
+  uint64_t bytes_received; // everything read from the sockets
+  uint64_t bytes_sent; // messages, without packet headers
+  std::vector<float> tick_latency_ms; // command sent until a snapshot shows it run
+  std::vector<float> snapshot_interval_ms; // between two snapshots of one bot
+
+  loadgen_stats()
+    : joined(0),
+      denied(0),
+      snapshots(0),
+      missing_baselines(0),
+      bytes_received(0),
+      bytes_sent(0)
+  {
+  }
+};
+
+///////////////////////////////////////////////////////////////////
+
+//
+// A client without window or prediction. Joins like the client program, sends command batches
+// at the client send rate and rebuilds every snapshot from its baseline to acknowledge it, so
+// the server does the same work as for a real player. Commands are made up by the pattern of
+// the config.
+//
+
+class bot {
+public:
+  static const int FRAME_MS = 16; // duration of each command, like a client frame
+  static const int SCRIPT_STEP_MS = 2000; // per side of the square walk
+  static const int MIN_RANDOM_STEP_MS = 500;
+  static const int MAX_RANDOM_STEP_MS = 2000;
+
+  bot(boost::asio::io_service& io_service, const loadgen_config& config, uint32_t room,
+      uint32_t seed, loadgen_stats& stats)
+    : config_(config),
+      room_(room),
+      stats_(stats),
+      strand_(io_service),
+      socket_(io_service),
+      write_queue_(new network::outbound_queue(strand_, socket_, network::write_limits())),
+      reader_(network::MAX_SERVER_FRAME_SIZE),
+      udp_socket_(io_service),
+      send_timer_(io_service),
+      player_id_(0),
+      snapshots_(0),
+      last_sequence_(0),
+      pending_ack_sequence_(0),
+      last_snapshot_us_(0),
+      next_command_id_(1),
+      start_ms_(0),
+      last_command_ms_(0),
+      buttons_(0),
+      turn_rate_(0),
+      next_change_ms_(0),
+      random_(seed)
+  {
+  }
+
+  void start(const boost::asio::ip::tcp::endpoint& server) {
+    start_ms_ = misc::get_time_ms();
+
+    if (config_.udp_only)
+      start_udp_only(boost::asio::ip::udp::endpoint(server.address(), server.port()));
+    else
+      socket_.async_connect(server, boost::bind(&bot::handle_connect, this,
+          boost::asio::placeholders::error));
+
+    start_send_timer();
+  }
+
+  bool has_snapshots() const {
+    return snapshots_;
+  }
+
+private:
+  // passes decoded messages to the process_message overloads
+  class message_handler {
+  public:
+    message_handler(bot& b)
+      : bot_(b)
+    {
+    }
+
+    template <typename T>
+    void operator()(T& message, const network::message_body& body) {
+      bot_.process_message(message, body);
+    }
+
+  private:
+    bot& bot_;
+  };
+
+  using message_dispatcher = network::message_dispatcher<network::server_messages,
+      message_handler>;
+
+  struct sent_command {
+    int id; // last command of a batch
+    uint64_t sent_us;
+  };
+
+  void process_message(const network::message_body& body) {
+    message_handler handler(*this);
+
+    if (!message_dispatcher::dispatch(body, handler))
+      DEBUG("unknown or invalid message, class id: "
+          << static_cast<int>(network::get_class_id(body)));
+  }
+
+  void process_message(const network::server_accept& m, const network::message_body& body) {
+    // commands cover the time from the join on, not the wait for it
+    if (!player_id_) {
+      stats_.joined++;
+      last_command_ms_ = misc::get_time_ms();
+    }
+
+    player_id_ = m.player_id;
+  }
+
+  void process_message(const network::server_deny& m, const network::message_body& body) {
+    DEBUG("join rejected, reason: " << m.reason);
+    stats_.denied++;
+    stop();
+  }
+
+  void process_message(const network::world_delta& delta, const network::message_body& body) {
+    if (last_sequence_ && !network::sequence_is_newer(delta.sequence, last_sequence_))
+      return;
+
+    network::world_snapshot snapshot((world()));
+
+    if (delta.baseline_sequence) {
+      auto baseline = std::find_if(baselines_.begin(), baselines_.end(),
+          [&delta](const network::world_snapshot& s) {
+            return s.sequence == delta.baseline_sequence;
+          });
+
+      if (baseline == baselines_.end()) {
+        stats_.missing_baselines++;
+        return;
+      }
+
+      snapshot = *baseline;
+    }
+
+    delta.apply(snapshot.snapshot);
+    snapshot.sequence = delta.sequence;
+    last_sequence_ = delta.sequence;
+    pending_ack_sequence_ = delta.sequence;
+
+    uint64_t now_us = misc::get_time_us();
+    if (last_snapshot_us_)
+      stats_.snapshot_interval_ms.push_back((now_us - last_snapshot_us_) / 1000.0f);
+
+    last_snapshot_us_ = now_us;
+    stats_.snapshots++;
+    snapshots_++;
+
+    // batches are done once the server ran their last command
+    boost::optional<player&> p = snapshot.snapshot.get_player(player_id_);
+
+    while (p && sent_commands_.size()
+        && sent_commands_.front().id <= p.get().get_last_command_id()) {
+      stats_.tick_latency_ms.push_back((now_us - sent_commands_.front().sent_us) / 1000.0f);
+      sent_commands_.pop_front();
+    }
+
+#if _COMPRESSION
+    baseline_bodies_.push_back(std::vector<uint8_t>(body.data, body.data + body.size));
+    if (baseline_bodies_.size() > network::SNAPSHOT_HISTORY_SIZE)
+      baseline_bodies_.pop_front();
+#endif
+
+    baselines_.push_back(snapshot);
+    if (baselines_.size() > network::SNAPSHOT_HISTORY_SIZE)
+      baselines_.pop_front();
+  }
+
+#if _COMPRESSION
+  void process_message(const network::compressed_message& m,
+      const network::message_body& body) {
+    const std::vector<uint8_t>* dictionary = nullptr;
+
+    for (size_t i = 0; i < baselines_.size() && m.dictionary_sequence; i++)
+      if (baselines_[i].sequence == m.dictionary_sequence)
+        dictionary = &baseline_bodies_[i];
+
+    if (m.dictionary_sequence && !dictionary) {
+      stats_.missing_baselines++;
+      return;
+    }
+
+    if (decompressor_.decompress(m.data.data(), m.data.size(),
+        dictionary ? dictionary->data() : nullptr, dictionary ? dictionary->size() : 0, m.size,
+        decompressed_body_))
+      process_message(decompressed_body_);
+  }
+
+#endif
+  void send_join_request() {
+    network::join_request m;
+    m.player_color_AABBGGRR = misc::generate_color_AABBGGRR();
+    m.room = room_;
+
+    if (config_.udp_only)
+      network::write_reliable(m, channel_);
+    else
+      network::write_object(m, *write_queue_);
+  }
+
+  // commands covering the time since the last batch, in frames
+  void add_commands(network::frame& outgoing) {
+    uint64_t now_ms = misc::get_time_ms();
+    int remaining_ms = now_ms - last_command_ms_;
+    last_command_ms_ = now_ms;
+
+    network::command_batch m;
+
+    while (remaining_ms > 0 && m.commands.size() < network::command_batch::MAX_COMMANDS) {
+      command c;
+      c.id = next_command_id_++;
+      c.duration_ms = std::min(remaining_ms, static_cast<int>(FRAME_MS));
+      c.vert_delta_angel = 0;
+      steer(c, now_ms);
+      m.commands.push_back(c);
+      remaining_ms -= c.duration_ms;
+    }
+
+    if (m.commands.empty())
+      return;
+
+    sent_commands_.push_back({ m.commands.back().id, misc::get_time_us() });
+    outgoing.add(network::make_message(m));
+  }
+
+  void steer(command& c, uint64_t now_ms) {
+    static const std::array<int, 4> square = {{ keyboard::button::forward,
+        keyboard::button::step_left, keyboard::button::backward, keyboard::button::step_right }};
+    static const std::array<int, 8> moves = {{ keyboard::button::forward,
+        keyboard::button::forward | keyboard::button::left,
+        keyboard::button::forward | keyboard::button::right, keyboard::button::backward,
+        keyboard::button::step_left, keyboard::button::step_right, keyboard::button::left, 0 }};
+
+    if (config_.pattern == loadgen_config::SCRIPT) {
+      buttons_ = square[(now_ms - start_ms_) / SCRIPT_STEP_MS % square.size()];
+    } else if (now_ms >= next_change_ms_) {
+      buttons_ = moves[std::uniform_int_distribution<size_t>(0, moves.size() - 1)(random_)];
+      turn_rate_ = std::uniform_real_distribution<float>(-1.5f, 1.5f)(random_);
+      next_change_ms_ = now_ms + std::uniform_int_distribution<int>(MIN_RANDOM_STEP_MS,
+          MAX_RANDOM_STEP_MS)(random_);
+    }
+
+    c.buttons = buttons_;
+    c.horz_delta_angel = turn_rate_ * c.duration_ms / 1000;
+  }
+
+  void add_snapshot_ack(network::frame& outgoing) {
+    if (!pending_ack_sequence_)
+      return;
+
+    network::snapshot_ack ack;
+    ack.sequence = pending_ack_sequence_;
+    pending_ack_sequence_ = 0;
+    outgoing.add(network::make_message(ack));
+  }
+
+  void send_frame(const network::frame& outgoing) {
+    stats_.bytes_sent += outgoing.size();
+
+    if (!config_.udp_only) {
+      if (!outgoing.empty())
+        network::write_frame(outgoing, *write_queue_);
+    } else if (!outgoing.empty() || channel_.has_messages_to_send(misc::get_time_ms())) {
+      network::write_packet(outgoing, 0, channel_, udp_socket_, udp_endpoint_);
+    }
+  }
+
+  void start_send_timer() {
+    send_timer_.expires_from_now(
+        boost::posix_time::milliseconds(1000 / config_.command_send_rate));
+    send_timer_.async_wait(boost::bind(&bot::handle_send_timer, this,
+        boost::asio::placeholders::error));
+  }
+
+  void handle_send_timer(const boost::system::error_code& error) {
+    if (error)
+      return;
+
+    network::frame outgoing;
+
+    if (player_id_)
+      add_commands(outgoing);
+
+    add_snapshot_ack(outgoing);
+    send_frame(outgoing);
+    start_send_timer();
+  }
+
+  void handle_connect(const boost::system::error_code& error) {
+    if (error) {
+      DEBUG("async_connect(): " << error.message());
+      stop();
+      return;
+    }
+
+    send_join_request();
+    start_read();
+  }
+
+  void start_read() {
+    socket_.async_read_some(reader_.prepare(),
+        boost::bind(&bot::handle_read, this,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred));
+  }
+
+  void handle_read(const boost::system::error_code& error, size_t size) {
+    if (error) {
+      DEBUG("async_read_some(): " << error.message());
+      stop();
+      return;
+    }
+
+    stats_.bytes_received += size;
+    reader_.commit(size);
+
+    if (!network::read_messages(reader_,
+        [this](const network::message_body& body) { process_message(body); })) {
+      stop();
+      return;
+    }
+
+    start_read();
+  }
+
+  void start_udp_only(const boost::asio::ip::udp::endpoint& server) {
+    boost::system::error_code error;
+    udp_endpoint_ = server;
+    udp_socket_.open(udp_endpoint_.protocol(), error);
+
+    if (!error)
+      udp_socket_.connect(udp_endpoint_, error);
+
+    if (error) {
+      DEBUG("udp socket: " << error.message());
+      stop();
+      return;
+    }
+
+    start_udp_receive();
+    send_join_request();
+  }
+
+  void start_udp_receive() {
+    udp_socket_.async_receive(boost::asio::buffer(udp_read_buffer_),
+        boost::bind(&bot::handle_udp_receive, this,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred));
+  }
+
+  void handle_udp_receive(const boost::system::error_code& error, size_t size) {
+    if (error == boost::asio::error::operation_aborted)
+      return;
+
+    network::packet_header header;
+
+    if (!error && header.read(udp_read_buffer_.data(), size)) {
+      stats_.bytes_received += size;
+
+      std::vector<std::vector<uint8_t>> messages;
+      size_t body_pos = channel_.read_packet(header, udp_read_buffer_.data(), size,
+          misc::get_time_ms(), messages);
+
+      for (auto& m : messages)
+        process_message(m);
+
+      if (body_pos)
+        network::read_messages(udp_read_buffer_.data() + body_pos, size - body_pos,
+            [this](const network::message_body& body) { process_message(body); });
+    }
+
+    start_udp_receive();
+  }
+
+  void stop() {
+    boost::system::error_code error;
+    socket_.close(error);
+    udp_socket_.close(error);
+    send_timer_.cancel(error);
+  }
+
+  const loadgen_config& config_;
+  uint32_t room_;
+  loadgen_stats& stats_;
+
+  // network
+  boost::asio::io_service::strand strand_; // of the write queue
+  boost::asio::ip::tcp::socket socket_;
+  std::shared_ptr<network::outbound_queue> write_queue_;
+  network::stream_reader reader_;
+  boost::asio::ip::udp::socket udp_socket_;
+  boost::asio::ip::udp::endpoint udp_endpoint_;
+  std::array<uint8_t, 65536> udp_read_buffer_;
+  network::reliable_channel channel_;
+  boost::asio::deadline_timer send_timer_;
+
+  // snapshots
+  uint16_t player_id_;
+  uint64_t snapshots_;
+  uint32_t last_sequence_;
+  uint32_t pending_ack_sequence_;
+  uint64_t last_snapshot_us_;
+  std::deque<network::world_snapshot> baselines_;
+#if _COMPRESSION
+  std::deque<std::vector<uint8_t>> baseline_bodies_; // messages of baselines_
+  network::decompressor decompressor_;
+  std::vector<uint8_t> decompressed_body_;
+#endif
+
+  // commands
+  int next_command_id_;
+  std::deque<sent_command> sent_commands_; // batches not yet run by the server
+  uint64_t start_ms_;
+  uint64_t last_command_ms_;
+  int buttons_;
+  float turn_rate_; // radians per second
+  uint64_t next_change_ms_;
+  std::mt19937 random_;
+};
+
+///////////////////////////////////////////////////////////////////
+
+//
+// Runs many bots against one server from a single io thread, started at a steady rate, and
+// reports what they measured: tick latency, snapshot inter-arrival jitter and bytes per client.
+// One thread keeps the measurements free of locks, run more processes for more load.
+//
+
+class loadgen {
+public:
+  static const int START_INTERVAL_MS = 10;
+  static const int PROGRESS_INTERVAL_MS = 5000;
+
+  loadgen(const loadgen_config& config)
+    : config_(config),
+      io_service_(),
+      resolver_(io_service_),
+      start_timer_(io_service_),
+      progress_timer_(io_service_),
+      stop_timer_(io_service_),
+      progress_snapshots_(0)
+  {
+  }
+
+  // returns false if a bot did not join or got no snapshot
+  bool run() {
+    boost::asio::ip::tcp::resolver::query query(boost::asio::ip::tcp::v4(), config_.host,
+        config_.port);
+    server_ = *resolver_.resolve(query);
+
+    start_ms_ = progress_ms_ = misc::get_time_ms();
+    start_bots();
+    start_progress_timer();
+
+    stop_timer_.expires_from_now(boost::posix_time::seconds(config_.seconds));
+    stop_timer_.async_wait([this](const boost::system::error_code& error) {
+      io_service_.stop();
+    });
+
+    io_service_.run();
+    return report();
+  }
+
+private:
+  void start_bots() {
+    size_t due = std::min<size_t>(config_.bots,
+        (misc::get_time_ms() - start_ms_ + START_INTERVAL_MS) * config_.start_rate / 1000);
+
+    while (bots_.size() < due) {
+      uint32_t room = bots_.size() % config_.rooms;
+      bots_.emplace_back(new bot(io_service_, config_, room, bots_.size() + 1, stats_));
+      bots_.back()->start(server_);
+    }
+
+    if (bots_.size() == config_.bots)
+      return;
+
+    start_timer_.expires_from_now(boost::posix_time::milliseconds(START_INTERVAL_MS));
+    start_timer_.async_wait([this](const boost::system::error_code& error) {
+      if (!error)
+        start_bots();
+    });
+  }
+
+  void start_progress_timer() {
+    progress_timer_.expires_from_now(boost::posix_time::milliseconds(PROGRESS_INTERVAL_MS));
+    progress_timer_.async_wait([this](const boost::system::error_code& error) {
+      if (error)
+        return;
+
+      uint64_t now_ms = misc::get_time_ms();
+      INFO("bots: " << bots_.size() << ", joined: " << stats_.joined << ", snapshots per second: "
+          << (stats_.snapshots - progress_snapshots_) * 1000 / (now_ms - progress_ms_));
+
+      progress_snapshots_ = stats_.snapshots;
+      progress_ms_ = now_ms;
+      start_progress_timer();
+    });
+  }
+
+  bool report() {
+    double seconds = (misc::get_time_ms() - start_ms_) / 1000.0;
+    size_t bots = std::max<size_t>(1, bots_.size());
+    size_t without_snapshots = std::count_if(bots_.begin(), bots_.end(),
+        [](const std::unique_ptr<bot>& b) { return !b->has_snapshots(); });
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "bots: " << bots_.size() << ", joined: " << stats_.joined << ", denied: "
+        << stats_.denied << ", without snapshots: " << without_snapshots << std::endl;
+    std::cout << "snapshots per bot per second: " << stats_.snapshots / bots / seconds
+        << ", missing baselines: " << stats_.missing_baselines << std::endl;
+    print_distribution("tick latency ms (command sent until a snapshot shows it run)",
+        stats_.tick_latency_ms);
+    print_distribution("snapshot interval ms", stats_.snapshot_interval_ms);
+    std::cout << "bytes per client per second, received: " << stats_.bytes_received / bots
+        / seconds << ", sent: " << stats_.bytes_sent / bots / seconds << std::endl;
+
+    return bots_.size() == config_.bots && stats_.joined == config_.bots && !without_snapshots;
+  }
+
+  // average, standard deviation as jitter, and percentiles
+  static void print_distribution(const std::string& name, std::vector<float>& values) {
+    if (values.empty()) {
+      std::cout << name << ": none" << std::endl;
+      return;
+    }
+
+    double sum = 0;
+    for (float v : values)
+      sum += v;
+
+    double average = sum / values.size();
+    double variance = 0;
+    for (float v : values)
+      variance += (v - average) * (v - average);
+
+    std::sort(values.begin(), values.end());
+
+    std::cout << name << ", average: " << average << ", jitter: "
+        << std::sqrt(variance / values.size()) << ", p50: " << values[values.size() / 2]
+        << ", p99: " << values[values.size() * 99 / 100] << ", max: " << values.back()
+        << std::endl;
+  }
+
+  loadgen_config config_;
+  loadgen_stats stats_;
+  boost::asio::io_service io_service_;
+  boost::asio::ip::tcp::resolver resolver_;
+  boost::asio::ip::tcp::endpoint server_;
+  boost::asio::deadline_timer start_timer_;
+  boost::asio::deadline_timer progress_timer_;
+  boost::asio::deadline_timer stop_timer_;
+  std::vector<std::unique_ptr<bot>> bots_; // after io_service_, closed while it is alive
+  uint64_t start_ms_;
+  uint64_t progress_ms_;
+  uint64_t progress_snapshots_;
+};
+
+#endif // LOADGEN_HPP_
@@ -0,0 +1,97 @@
+#ifndef MESSAGE_BUFFER_HPP_
+#define MESSAGE_BUFFER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/intrusive_ptr.hpp>
+
+namespace network {
+  class buffer_pool;
+
+  // message data with an intrusive reference count, returned to its pool when released
+  class pooled_buffer {
+  public:
+    std::vector<uint8_t> data;
+
+  private:
+    friend class buffer_pool;
+    friend void intrusive_ptr_add_ref(const pooled_buffer* buffer);
+    friend void intrusive_ptr_release(const pooled_buffer* buffer);
+
+    pooled_buffer(buffer_pool* pool)
+      : pool_(pool),
+        references_(0)
+    {
+    }
+
+    buffer_pool* pool_;
+    mutable std::atomic<int> references_;
+  };
+
+  // immutable once built, shared by every write of the same message without copying it
+  using message_buffer = boost::intrusive_ptr<const pooled_buffer>;
+  using writable_buffer = boost::intrusive_ptr<pooled_buffer>;
+
+  ///////////////////////////////////////////////////////////////////
+
+  // keeps released buffers with their capacity, so steady traffic does not allocate
+  class buffer_pool {
+  public:
+    static const size_t MAX_POOLED_BUFFERS = 1024;
+
+    // returns an empty buffer
+    writable_buffer acquire() {
+      pooled_buffer* buffer = nullptr;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (free_.size()) {
+          buffer = free_.back().release();
+          free_.pop_back();
+        }
+      }
+
+      return writable_buffer(buffer ? buffer : new pooled_buffer(this));
+    }
+
+    // shared by client and server, never destroyed since buffers may be released during exit
+    static buffer_pool& get_default() {
+      static buffer_pool* pool = new buffer_pool();
+      return *pool;
+    }
+
+  private:
+    friend void intrusive_ptr_release(const pooled_buffer* buffer);
+
+    void release(pooled_buffer* buffer) {
+      buffer->data.clear();
+
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (free_.size() < MAX_POOLED_BUFFERS)
+        free_.emplace_back(buffer);
+      else
+        delete buffer;
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<pooled_buffer>> free_;
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  void intrusive_ptr_add_ref(const pooled_buffer* buffer) {
+    buffer->references_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void intrusive_ptr_release(const pooled_buffer* buffer) {
+    if (buffer->references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      buffer->pool_->release(const_cast<pooled_buffer*>(buffer));
+  }
+}
+
+#endif // MESSAGE_BUFFER_HPP_
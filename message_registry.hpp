@@ -0,0 +1,74 @@
+#ifndef MESSAGE_REGISTRY_HPP_
+#define MESSAGE_REGISTRY_HPP_
+
+#include <cstdint>
+#include <type_traits>
+
+//
+// Message types are listed in type lists, one per direction. Everything that depends on the set
+// of messages is generated from the lists at compile time: the check for duplicate class ids,
+// whether a type may be sent, and the largest encoded size. The dispatch table of received
+// messages is in network.hpp (message_dispatcher).
+//
+
+namespace network {
+  template <typename... Messages>
+  struct message_list {
+  };
+
+  // joins two lists
+  template <typename A, typename B>
+  struct concat_messages;
+
+  template <typename... A, typename... B>
+  struct concat_messages<message_list<A...>, message_list<B...>> {
+    using type = message_list<A..., B...>;
+  };
+
+  // true if T is in list
+  template <typename T, typename List>
+  struct contains_message : std::false_type {
+  };
+
+  template <typename T, typename Head, typename... Tail>
+  struct contains_message<T, message_list<Head, Tail...>>
+    : std::integral_constant<bool, std::is_same<T, Head>::value
+        || contains_message<T, message_list<Tail...>>::value> {
+  };
+
+  // true if a type in list has class id
+  template <uint8_t CLASS_ID, typename List>
+  struct contains_class_id : std::false_type {
+  };
+
+  template <uint8_t CLASS_ID, typename Head, typename... Tail>
+  struct contains_class_id<CLASS_ID, message_list<Head, Tail...>>
+    : std::integral_constant<bool, Head::CLASS_ID == CLASS_ID
+        || contains_class_id<CLASS_ID, message_list<Tail...>>::value> {
+  };
+
+  // true if two types in list share a class id
+  template <typename List>
+  struct has_duplicate_class_ids : std::false_type {
+  };
+
+  template <typename Head, typename... Tail>
+  struct has_duplicate_class_ids<message_list<Head, Tail...>>
+    : std::integral_constant<bool, contains_class_id<Head::CLASS_ID, message_list<Tail...>>::value
+        || has_duplicate_class_ids<message_list<Tail...>>::value> {
+  };
+
+  // largest object data of the types in list, see MAX_SIZE of each message
+  template <typename List>
+  struct max_message_size : std::integral_constant<size_t, 0> {
+  };
+
+  template <typename Head, typename... Tail>
+  struct max_message_size<message_list<Head, Tail...>>
+    : std::integral_constant<size_t,
+        (Head::MAX_SIZE > max_message_size<message_list<Tail...>>::value)
+        ? Head::MAX_SIZE : max_message_size<message_list<Tail...>>::value> {
+  };
+}
+
+#endif // MESSAGE_REGISTRY_HPP_
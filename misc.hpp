@@ -3,6 +3,7 @@
 
 #include <ctime>
 #include <fstream>
+#include <pthread.h>
 #include <iostream>
 #include <random>
 #include <string>
@@ -41,6 +42,10 @@ namespace misc {
     return std::chrono::system_clock::now().time_since_epoch() / std::chrono::milliseconds(1);
   }
 
+  uint64_t get_time_us() {
+    return std::chrono::system_clock::now().time_since_epoch() / std::chrono::microseconds(1);
+  }
+
   uint32_t generate_color_AABBGGRR() {
     std::random_device rd;
     std::mt19937_64 gen(rd());
@@ -49,11 +54,21 @@ namespace misc {
     return (0xff << 24) | (dis(gen) << 16) | (dis(gen) << 8) | dis(gen);
   }
 
+  // runs thread on one cpu only, returns false if not allowed
+  bool pin_thread(std::thread& thread, int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    return !pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+  }
+
   std::string get_datetime() {
     char buffer[32];
     time_t rawtime;
+    struct tm timeinfo; // localtime_r, log lines are written from several threads
     time(&rawtime);
-    strftime(buffer, 32, "%F %I:%M:%S", localtime(&rawtime));
+    strftime(buffer, 32, "%F %I:%M:%S", localtime_r(&rawtime, &timeinfo));
 
     return std::string(buffer);
   }
@@ -0,0 +1,182 @@
+#ifndef MOVEMENT_HPP_
+#define MOVEMENT_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "command.hpp"
+#include "keyboard.hpp"
+#include "quantization.hpp"
+
+//
+// Player movement by commands. The state of many players is kept in parallel arrays and the
+// commands of a tick are applied in one loop without branches, which the compiler turns into
+// vector instructions. A single player runs the same code on one element, so client prediction
+// and the server compute identical values.
+//
+
+namespace movement {
+  const int MOVE_SPEED = 2; // m/s
+  const int TURN_SPEED = 3; // rad/s
+
+  // limits of commands accepted from clients, see is_valid
+  const float MAX_DELTA_ANGEL = 64; // rad
+  const int MAX_DURATION_MS = 1000;
+
+  // largest angel sin_cos reduces correctly, far above any angel of a valid command
+  const int MAX_ANGEL = 1024;
+
+  // false for commands that could move a player beyond the limits above, or contain nan
+  inline bool is_valid(const command& cmd) {
+    return std::fabs(cmd.horz_delta_angel) <= MAX_DELTA_ANGEL
+        && std::fabs(cmd.vert_delta_angel) <= MAX_DELTA_ANGEL
+        && cmd.duration_ms >= 0 && cmd.duration_ms <= MAX_DURATION_MS;
+  }
+
+  // sin and cos by polynomials of the half angel, without calls or branches so loops using it
+  // vectorize, absolute error about 1e-6 for angels of valid commands
+  inline void sin_cos(float angel, float& s, float& c) {
+    const float two_pi = 2 * M_PI;
+
+    // reduce to [-pi, pi], truncation rounds towards zero so shift to positive first
+    int turns = static_cast<int>(angel * (1 / two_pi) + 0.5f + MAX_ANGEL) - MAX_ANGEL;
+    float h = (angel - turns * two_pi) * 0.5f; // [-pi/2, pi/2]
+    float h2 = h * h;
+
+    float sh = h * (1 + h2 * (-1.0f / 6 + h2 * (1.0f / 120 + h2 * (-1.0f / 5040
+        + h2 * (1.0f / 362880 + h2 * (-1.0f / 39916800))))));
+    float ch = 1 + h2 * (-1.0f / 2 + h2 * (1.0f / 24 + h2 * (-1.0f / 720
+        + h2 * (1.0f / 40320 + h2 * (-1.0f / 3628800 + h2 * (1.0f / 479001600))))));
+
+    s = 2 * sh * ch;
+    c = ch * ch - sh * sh;
+  }
+
+  // angel wrapped into [-pi, pi] without a branch or call, like the reduction in sin_cos
+  inline float wrap_angel(float angel) {
+    const float two_pi = 2 * M_PI;
+    int turns = static_cast<int>(angel * (1 / two_pi) + 0.5f + MAX_ANGEL) - MAX_ANGEL;
+
+    return angel - turns * two_pi;
+  }
+
+  // position kept inside the range that can be sent, min and max vectorize unlike a branch
+  inline float clamp_position(float position) {
+    const float limit = quantization::POSITION_LIMIT;
+    const float last = limit - 1.0f / quantization::POSITION_STEPS_PER_METER;
+
+    return std::min(std::max(position, -limit), last);
+  }
+
+  // 1 if button is pressed, 0 otherwise
+  inline float pressed(int buttons, keyboard::button b) {
+    return (buttons & b) / b; // b is a single bit, no branch unlike a comparison
+  }
+
+  // 1 or -1 for the direction of two opposite buttons, the first wins if both are pressed
+  inline float direction(int buttons, keyboard::button positive, keyboard::button negative) {
+    float p = pressed(buttons, positive);
+    return p - pressed(buttons, negative) * (1 - p);
+  }
+
+  // moves one player by the fields of a command
+  inline void apply_command(int buttons, float horz_delta_angel, float vert_delta_angel,
+      int duration_ms, float& x, float& y, float& z, float& horz_angel, float& vert_angel) {
+    float turn = duration_ms * (TURN_SPEED / 1000.0f);
+    float distance = duration_ms * (MOVE_SPEED / 1000.0f);
+
+    // kept in range so small turns add up at full precision, see quantization
+    horz_angel = wrap_angel(horz_angel + horz_delta_angel
+        + turn * direction(buttons, keyboard::button::left, keyboard::button::right));
+    vert_angel = wrap_angel(vert_angel + vert_delta_angel);
+
+    float s, c;
+    sin_cos(horz_angel, s, c);
+
+    float forward = distance * direction(buttons, keyboard::button::forward,
+        keyboard::button::backward);
+    float step = distance * direction(buttons, keyboard::button::step_right,
+        keyboard::button::step_left);
+
+    // strafing moves by the angel turned right by pi/2
+    x = clamp_position(x + forward * c + step * s);
+    z = clamp_position(z + step * c - forward * s);
+    y = clamp_position(y + distance * (pressed(buttons, keyboard::button::up)
+        - pressed(buttons, keyboard::button::down)));
+  }
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // Player state and one command per player in parallel arrays, element i of every array
+  // belongs to the same player.
+  //
+
+  class batch {
+  public:
+    // player state
+    std::vector<float> x, y, z;
+    std::vector<float> horz_angel, vert_angel;
+
+    // command fields
+    std::vector<int> buttons;
+    std::vector<float> horz_delta_angel, vert_delta_angel;
+    std::vector<int> duration_ms;
+
+    size_t size() const {
+      return x.size();
+    }
+
+    void clear() {
+      resize(0);
+    }
+
+    // capacity is kept when shrinking, so a batch filled by index does not allocate
+    void resize(size_t n) {
+      x.resize(n);
+      y.resize(n);
+      z.resize(n);
+      horz_angel.resize(n);
+      vert_angel.resize(n);
+      buttons.resize(n);
+      horz_delta_angel.resize(n);
+      vert_delta_angel.resize(n);
+      duration_ms.resize(n);
+    }
+
+    // sets element i to the state of a player and its command
+    void set(size_t i, float px, float py, float pz, float ph, float pv, const command& cmd) {
+      x[i] = px;
+      y[i] = py;
+      z[i] = pz;
+      horz_angel[i] = ph;
+      vert_angel[i] = pv;
+      buttons[i] = cmd.buttons;
+      horz_delta_angel[i] = cmd.horz_delta_angel;
+      vert_delta_angel[i] = cmd.vert_delta_angel;
+      duration_ms[i] = cmd.duration_ms;
+    }
+
+    // applies every command to its player
+    void run() {
+      size_t n = size();
+      float* px = x.data();
+      float* py = y.data();
+      float* pz = z.data();
+      float* ph = horz_angel.data();
+      float* pv = vert_angel.data();
+      const int* pb = buttons.data();
+      const float* pdh = horz_delta_angel.data();
+      const float* pdv = vert_delta_angel.data();
+      const int* pd = duration_ms.data();
+
+      // arrays never overlap, the compiler would give up proving that at run time
+#pragma GCC ivdep
+      for (size_t i = 0; i < n; i++)
+        apply_command(pb[i], pdh[i], pdv[i], pd[i], px[i], py[i], pz[i], ph[i], pv[i]);
+    }
+  };
+}
+
+#endif // MOVEMENT_HPP_
@@ -1,15 +1,54 @@
 #ifndef NETWORK_HPP_
 #define NETWORK_HPP_
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <deque>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/asio.hpp>
+#include "binary_archive.hpp"
+#include "bitstream.hpp"
+#include "datagram_socket.hpp"
+#include "frame.hpp"
+#include "message_buffer.hpp"
+#include "message_registry.hpp"
+#include "misc.hpp"
+#include "outbound_queue.hpp"
+#include "reliable_channel.hpp"
+#include "stream_reader.hpp"
+#include "quantization.hpp"
 #include "world.hpp"
 
+#if _COMPRESSION
+#include "compression.hpp"
+#endif
+
+#if _IO_URING
+#include "uring_socket.hpp"
+#endif
+
+class world_instance;
+
 namespace network {
-  const int HEADER_SIZE = 8; // bytes
-  const int CLASS_ID_SIZE = 3; // bytes
+#if _TEXT_ARCHIVE
+  const int HEADER_SIZE = 8; // bytes, zero-padded ascii body size
+  const int CLASS_ID_SIZE = 3; // bytes, zero-padded ascii class id
+#else
+  const int HEADER_SIZE = 4; // bytes, little-endian body size
+  const int CLASS_ID_SIZE = 1; // bytes
+#endif
+  const size_t SNAPSHOT_HISTORY_SIZE = 32; // snapshots kept as possible delta baselines
+  const uint64_t CONNECTION_TIMEOUT_MS = 5000; // udp peers silent for longer are dropped
+  const int INTERPOLATION_TIME_MS = 300; // clients show snapshots this long after receiving them
+
+  // udp socket of the server, selected by build flag, see makefile
+#if _IO_URING
+  using datagram_socket = uring_socket;
+#else
+  using datagram_socket = asio_socket;
+#endif
 
   ///////////////////////////////////////////////////////////////////
 
@@ -18,11 +57,13 @@ namespace network {
     static const uint8_t CLASS_ID = 10;
 
     world snapshot;
+    uint32_t sequence;
     uint64_t server_time_ms;
     uint64_t client_time_ms;
 
     world_snapshot(world world)
       : snapshot(world),
+        sequence(0),
         server_time_ms(0),
         client_time_ms(0)
     {
@@ -34,27 +75,295 @@ namespace network {
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version) {
       ar & snapshot;
+      ar & sequence;
       ar & server_time_ms;
       ar & client_time_ms;
     }
   };
 
+  using world_snapshot_ptr = std::shared_ptr<const world_snapshot>;
+
   ///////////////////////////////////////////////////////////////////
 
-  class connection {
+  // changed fields of one player, or all fields of a player new to the baseline
+  class player_delta {
   public:
-    boost::asio::ip::tcp::socket socket;
-    std::vector<uint8_t> read_buffer;
-    uint8_t player_id;
+    enum field {
+      added           = (1 << 0), // player is not in baseline, color is sent
+      x               = (1 << 1),
+      y               = (1 << 2),
+      z               = (1 << 3),
+      horz_angel      = (1 << 4),
+      vert_angel      = (1 << 5),
+      last_command_id = (1 << 6),
+      all             = (1 << 7) - 1
+    };
+
+    static const int FIELD_BITS = 7;
+    static const int SMALL_COMMAND_ID_DELTA_BITS = 8;
+    static const int ID_BITS = 16;
+    static const int MAX_BITS = ID_BITS + FIELD_BITS + 32 + 3 * quantization::POSITION_BITS
+        + 2 * quantization::ANGEL_BITS + 1 + 32;
+
+    uint8_t fields; // changed fields (player_delta::field)
+
+    player_delta(const boost::optional<const player&>& from, const player& to)
+      : fields(0)
+    {
+      if (!from) {
+        fields = all;
+        return;
+      }
+
+      const player& f = from.get();
+
+      // compared as sent, changes below one step are not worth a field
+      if (changed_position(f.get_x(), to.get_x())) fields |= x;
+      if (changed_position(f.get_y(), to.get_y())) fields |= y;
+      if (changed_position(f.get_z(), to.get_z())) fields |= z;
+      if (changed_angel(f.get_horz_angel(), to.get_horz_angel())) fields |= horz_angel;
+      if (changed_angel(f.get_vert_angel(), to.get_vert_angel())) fields |= vert_angel;
+      if (f.get_last_command_id() != to.get_last_command_id()) fields |= last_command_id;
+    }
+
+    // writes changed fields of player, "from" is baseline state of the same player
+    void write(bit_writer& out, const boost::optional<const player&>& from,
+        const player& to) const {
+      out.write(to.get_id(), ID_BITS);
+      out.write(fields, FIELD_BITS);
+
+      if (fields & added)
+        out.write(to.get_color_AABBGGRR(), 32);
+
+      if (fields & x) out.write(quantization::position_to_int(to.get_x()), POSITION_BITS);
+      if (fields & y) out.write(quantization::position_to_int(to.get_y()), POSITION_BITS);
+      if (fields & z) out.write(quantization::position_to_int(to.get_z()), POSITION_BITS);
+      if (fields & horz_angel)
+        out.write(quantization::angel_to_int(to.get_horz_angel()), ANGEL_BITS);
+      if (fields & vert_angel)
+        out.write(quantization::angel_to_int(to.get_vert_angel()), ANGEL_BITS);
+
+      if (fields & last_command_id) {
+        // usually a small step forward from baseline
+        uint32_t delta = to.get_last_command_id() - (from ? from.get().get_last_command_id() : 0);
+        bool small = delta < (1 << SMALL_COMMAND_ID_DELTA_BITS);
+
+        out.write_bool(small);
+        out.write(delta, small ? SMALL_COMMAND_ID_DELTA_BITS : 32);
+      }
+    }
+
+    // reads changed fields of a player and applies them to world, which holds the baseline
+    static void read(bit_reader& in, world& w) {
+      uint16_t id = in.read(ID_BITS);
+      uint8_t fields = in.read(FIELD_BITS);
+
+      if (fields & added) {
+        player p;
+        p.set_id(id);
+        p.set_color_AABBGGRR(in.read(32));
+        w.set_player(p);
+      }
+
+      boost::optional<player&> opt_p = w.get_player(id);
+
+      if (!opt_p)
+        throw std::runtime_error("error, player_delta: player not in baseline");
+
+      player& p = opt_p.get();
+
+      if (fields & x) p.set_x(quantization::int_to_position(in.read(POSITION_BITS)));
+      if (fields & y) p.set_y(quantization::int_to_position(in.read(POSITION_BITS)));
+      if (fields & z) p.set_z(quantization::int_to_position(in.read(POSITION_BITS)));
+      if (fields & horz_angel) p.set_horz_angel(quantization::int_to_angel(in.read(ANGEL_BITS)));
+      if (fields & vert_angel) p.set_vert_angel(quantization::int_to_angel(in.read(ANGEL_BITS)));
+
+      if (fields & last_command_id) {
+        bool small = in.read_bool();
+        uint32_t delta = in.read(small ? SMALL_COMMAND_ID_DELTA_BITS : 32);
+
+        p.set_last_command_id(p.get_last_command_id() + delta);
+      }
+    }
+
+  private:
+    static const int POSITION_BITS = quantization::POSITION_BITS;
+    static const int ANGEL_BITS = quantization::ANGEL_BITS;
+
+    static bool changed_position(float from, float to) {
+      return quantization::position_to_int(from) != quantization::position_to_int(to);
+    }
+
+    static bool changed_angel(float from, float to) {
+      return quantization::angel_to_int(from) != quantization::angel_to_int(to);
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  // world state as a difference to a snapshot the client has acknowledged
+  class world_delta {
+  public:
+    static const uint8_t CLASS_ID = 11;
 
-    connection(boost::asio::io_service& io_service)
-      : socket(io_service),
-        player_id(0)
+    uint32_t sequence;
+    uint32_t baseline_sequence; // 0 if delta is against an empty world
+    uint64_t server_time_ms;
+    std::vector<uint16_t> removed_player_ids;
+    std::vector<uint8_t> player_data; // bit-packed player deltas, see player_delta
+
+    // fields as in serialize, every player removed or changed in every field
+    static const size_t MAX_SIZE = archived_size<decltype(sequence),
+        decltype(baseline_sequence), decltype(server_time_ms)>()
+        + archived_size(world::MAX_PLAYERS, archived_size<uint16_t>())
+        + archived_size((16 + world::MAX_PLAYERS * player_delta::MAX_BITS + 7) / 8,
+            archived_size<uint8_t>());
+
+    world_delta()
+      : sequence(0),
+        baseline_sequence(0),
+        server_time_ms(0)
     {
     }
+
+    world_delta(const world& baseline, const world& current)
+      : sequence(0),
+        baseline_sequence(0),
+        server_time_ms(0)
+    {
+      for (const player& p : baseline.get_players())
+        if (!current.player_exists(p.get_id()))
+          removed_player_ids.push_back(p.get_id());
+
+      // count changed players first, the reader needs the count up front
+      std::vector<std::pair<const player*, player_delta>> deltas;
+
+      for (const player& p : current.get_players()) {
+        player_delta d(baseline.get_player(p.get_id()), p);
+        if (d.fields)
+          deltas.push_back(std::make_pair(&p, d));
+      }
+
+      bit_writer out(player_data);
+      out.write(deltas.size(), 16);
+
+      for (auto& d : deltas)
+        d.second.write(out, baseline.get_player(d.first->get_id()), *d.first);
+    }
+
+    void apply(world& w) const {
+      for (uint16_t id : removed_player_ids)
+        w.remove_player(id);
+
+      bit_reader in(player_data);
+      size_t count = in.read(16);
+
+      for (size_t i = 0; i < count; i++)
+        player_delta::read(in, w);
+    }
+
+  private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+      ar & sequence;
+      ar & baseline_sequence;
+      ar & server_time_ms;
+      ar & removed_player_ids;
+      ar & player_data;
+    }
   };
 
-  using connection_ptr = std::shared_ptr<connection>;
+  ///////////////////////////////////////////////////////////////////
+
+  class snapshot_ack {
+  public:
+    static const uint8_t CLASS_ID = 12;
+
+    uint32_t sequence;
+
+    static const size_t MAX_SIZE = archived_size<decltype(sequence)>();
+
+  private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+      ar & sequence;
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  // commands since the last send, after a few older ones not yet acknowledged in a snapshot
+  class command_batch {
+  public:
+    static const uint8_t CLASS_ID = 13;
+    static const size_t MAX_COMMANDS = 64;
+
+    std::vector<command> commands; // ascending ids
+
+    static const size_t MAX_SIZE = archived_size(MAX_COMMANDS, command::MAX_SIZE);
+
+  private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+      ar & commands;
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+#if _COMPRESSION
+  // a message body compressed with the body of an acknowledged snapshot as dictionary
+  class compressed_message {
+  public:
+    static const uint8_t CLASS_ID = 14;
+
+    uint32_t dictionary_sequence; // 0 if compressed without dictionary
+    uint32_t size; // bytes, original body
+    std::vector<uint8_t> data;
+
+    // only sent if smaller than the original body
+    static const size_t MAX_SIZE = archived_size<decltype(dictionary_sequence), decltype(size)>()
+        + archived_size(CLASS_ID_SIZE + world_delta::MAX_SIZE, archived_size<uint8_t>());
+
+  private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+      ar & dictionary_sequence;
+      ar & size;
+      ar & data;
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+#endif
+  // player data sent to one client per snapshot, players that do not fit wait for later
+  // snapshots by priority
+  struct snapshot_budget {
+    size_t max_bytes;
+
+    snapshot_budget()
+      : max_bytes(MAX_PACKET_SIZE - 128) // room for headers, removed players, reliable messages
+    {
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  // snapshot as sent to one client
+  struct sent_snapshot {
+    world_snapshot_ptr snapshot;
+    message_buffer message; // uncompressed world delta
+    uint64_t sent_ms;
+  };
 
   ///////////////////////////////////////////////////////////////////
 
@@ -63,6 +372,10 @@ namespace network {
     static const uint8_t CLASS_ID = 4;
 
     uint32_t player_color_AABBGGRR;
+    uint32_t room; // world instance to join, created by the first player asking for it
+
+    static const size_t MAX_SIZE = archived_size<decltype(player_color_AABBGGRR),
+        decltype(room)>();
 
   private:
     friend class boost::serialization::access;
@@ -70,6 +383,7 @@ namespace network {
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version) {
       ar & player_color_AABBGGRR;
+      ar & room;
     }
   };
 
@@ -79,7 +393,10 @@ namespace network {
   public:
     static const uint8_t CLASS_ID = 5;
 
-    uint8_t player_id;
+    uint16_t player_id;
+    uint32_t udp_token; // identifies the client in packets
+
+    static const size_t MAX_SIZE = archived_size<decltype(player_id), decltype(udp_token)>();
 
   private:
     friend class boost::serialization::access;
@@ -87,6 +404,7 @@ namespace network {
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version) {
       ar & player_id;
+      ar & udp_token;
     }
   };
 
@@ -95,9 +413,12 @@ namespace network {
   class server_deny {
   public:
     static const uint8_t CLASS_ID = 6;
+    static const size_t MAX_REASON_SIZE = 128;
 
     std::string reason;
 
+    static const size_t MAX_SIZE = archived_size(MAX_REASON_SIZE, archived_size<char>());
+
   private:
     friend class boost::serialization::access;
 
@@ -109,69 +430,460 @@ namespace network {
 
   ///////////////////////////////////////////////////////////////////
 
+  // messages sent by clients, handled by the server
+  using client_messages = message_list<join_request, command_batch, snapshot_ack>;
+
+  // messages sent by the server, handled by clients
+#if _COMPRESSION
+  using server_messages = message_list<server_accept, server_deny, world_delta,
+      compressed_message>;
+#else
+  using server_messages = message_list<server_accept, server_deny, world_delta>;
+#endif
+
+  using protocol_messages = concat_messages<client_messages, server_messages>::type;
+
+  static_assert(!has_duplicate_class_ids<protocol_messages>::value,
+      "error, duplicate message class id");
+
+  // bytes, largest message with header, the text format takes up to about 6 characters per
+  // binary byte
+#if _TEXT_ARCHIVE
+  const size_t FRAME_SIZE_FACTOR = 6;
+#else
+  const size_t FRAME_SIZE_FACTOR = 1;
+#endif
+  const size_t MAX_CLIENT_FRAME_SIZE = HEADER_SIZE
+      + (CLASS_ID_SIZE + max_message_size<client_messages>::value) * FRAME_SIZE_FACTOR;
+  const size_t MAX_SERVER_FRAME_SIZE = HEADER_SIZE
+      + (CLASS_ID_SIZE + max_message_size<server_messages>::value) * FRAME_SIZE_FACTOR;
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // One client of the server. The socket, receive buffer, udp channel and snapshot state are
+  // only used on the strand of the connection, so connections are handled in parallel. The
+  // command queue and visible players belong to the simulation strand of its world instance.
+  //
+
+  class connection {
+  public:
+    boost::asio::io_service::strand strand;
+    boost::asio::ip::tcp::socket socket;
+    outbound_queue_ptr write_queue;
+    stream_reader reader;
+    uint16_t player_id;
+
+    // room joined, null before. set once on the server's control strand and read from others,
+    // always through std::atomic_load
+    std::shared_ptr<world_instance> instance;
+
+    uint32_t acked_sequence; // last snapshot acknowledged by client, 0 if none
+    std::deque<sent_snapshot> sent_snapshots; // possible delta baselines
+
+    // time from sending a snapshot to its ack, including the wait for the next commands of the
+    // client, read by the simulation strand for lag compensation
+    std::atomic<uint32_t> rtt_ms;
+    int interpolation_time_ms;
+    std::vector<uint16_t> visible_player_ids; // ascending, see interest_area
+
+    // by slot of player id, grows while a changed player is not sent. sized when the player
+    // joins a room.
+    std::vector<float> player_priorities;
+
+    // commands received but not yet simulated, ascending by id, run at the tick rate
+    std::deque<command> queued_commands;
+    int64_t command_allowance_us; // simulation time the player may still use this tick
+    bool buffering_commands; // true while the queue fills up after running dry
+    uint64_t buffering_since_ms;
+#if _COMPRESSION
+    compressor snapshot_compressor;
+#endif
+
+    // udp channel, used for snapshots once the client has sent a packet, and for everything
+    // if the client joined over udp
+    uint32_t udp_token;
+    bool udp_bound;
+    bool udp_only;
+    boost::asio::ip::udp::endpoint udp_endpoint;
+    reliable_channel channel;
+    std::atomic<uint64_t> last_receive_ms; // read by the simulation strand for timeouts
+
+    connection(boost::asio::io_service& io_service, const write_limits& limits = write_limits(),
+        size_t max_frame_size = MAX_CLIENT_FRAME_SIZE)
+      : strand(io_service),
+        socket(io_service),
+        write_queue(new outbound_queue(strand, socket, limits)),
+        reader(max_frame_size),
+        player_id(0),
+        acked_sequence(0),
+        rtt_ms(0),
+        interpolation_time_ms(INTERPOLATION_TIME_MS),
+        command_allowance_us(0),
+        buffering_commands(true),
+        buffering_since_ms(0),
+        udp_token(0),
+        udp_bound(false),
+        udp_only(false),
+        last_receive_ms(0)
+    {
+    }
+
+    ~connection() {
+      write_queue->close();
+    }
+  };
+
+  using connection_ptr = std::shared_ptr<connection>;
+
+  ///////////////////////////////////////////////////////////////////
+
+  // class id and object data of one received message, pointing into a receive buffer
+  struct message_body {
+    const uint8_t* data;
+    size_t size;
+
+    message_body(const uint8_t* body_data, size_t body_size)
+      : data(body_data),
+        size(body_size)
+    {
+    }
+
+    message_body(const std::vector<uint8_t>& body_data)
+      : data(body_data.data()),
+        size(body_data.size())
+    {
+    }
+  };
+
+#if _TEXT_ARCHIVE
+  // appends everything written to a stream to a byte vector
+  class vector_streambuf : public std::streambuf {
+  public:
+    vector_streambuf(std::vector<uint8_t>& data)
+      : data_(data)
+    {
+    }
+
+  protected:
+    virtual int_type overflow(int_type c) {
+      if (!traits_type::eq_int_type(c, traits_type::eof()))
+        data_.push_back(static_cast<uint8_t>(c));
+
+      return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize n) {
+      data_.insert(data_.end(), s, s + n);
+      return n;
+    }
+
+  private:
+    std::vector<uint8_t>& data_;
+  };
+
+  // reads a stream straight from a receive buffer
+  class memory_streambuf : public std::streambuf {
+  public:
+    memory_streambuf(const uint8_t* data, size_t size) {
+      char* begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+      setg(begin, begin, begin + size);
+    }
+  };
+
+  // writes number as space-padded ascii
+  void write_number(uint8_t* data, size_t size, uint32_t number) {
+    for (size_t i = size; i-- > 0; number /= 10)
+      data[i] = (number || i == size - 1) ? '0' + number % 10 : ' ';
+  }
+#endif
+
   template <typename T>
-  void deserialize(T& object, const std::vector<uint8_t>& body_data) {
-    std::string archive_data(body_data.begin() + CLASS_ID_SIZE, body_data.end());
-    std::istringstream archive_stream(archive_data);
+  void deserialize(T& object, const message_body& body) {
+    if (body.size < CLASS_ID_SIZE)
+      throw std::runtime_error("error, deserialize: message body too short");
+
+#if _TEXT_ARCHIVE
+    memory_streambuf archive_buffer(body.data + CLASS_ID_SIZE, body.size - CLASS_ID_SIZE);
+    std::istream archive_stream(&archive_buffer);
     boost::archive::text_iarchive archive(archive_stream);
     archive >> object;
+#else
+    binary_iarchive archive(body.data + CLASS_ID_SIZE, body.data + body.size);
+    archive >> object;
+#endif
   }
 
+  // returns false instead of throwing if body is too short or corrupt
   template <typename T>
-  void build_message(std::vector<uint8_t>& message, uint8_t class_id, const T& object) {
-    // get object data (serialize)
-    std::ostringstream archive_stream;
-    boost::archive::text_oarchive archive(archive_stream);
-    archive << object;
-    const std::string& object_str = archive_stream.str();
+  bool try_deserialize(T& object, const message_body& body) {
+    try {
+      deserialize(object, body);
+      return true;
+    } catch (const std::exception&) {
+      return false;
+    }
+  }
+
+  // serializes the object straight after its header and T::CLASS_ID, header is set afterwards
+  template <typename T>
+  void build_message(std::vector<uint8_t>& message, const T& object) {
+    static_assert(contains_message<T, protocol_messages>::value,
+        "error, message type is not in client_messages or server_messages");
+
+    const uint8_t class_id = T::CLASS_ID;
+
+    size_t header_pos = message.size();
+
+    // reserve message header, set class id
+    message.resize(header_pos + HEADER_SIZE + CLASS_ID_SIZE);
+
+#if _TEXT_ARCHIVE
+    write_number(&message[header_pos + HEADER_SIZE], CLASS_ID_SIZE, class_id);
+
+    // set object data (serialize), archive is closed before the size is taken
+    {
+      vector_streambuf archive_buffer(message);
+      std::ostream archive_stream(&archive_buffer);
+      boost::archive::text_oarchive archive(archive_stream);
+      archive << object;
+    }
 
     // set object data size
-    std::ostringstream header_stream;
-    header_stream << std::setw(HEADER_SIZE)
-        << std::to_string(object_str.size() + CLASS_ID_SIZE);
-    const std::string& header_str = header_stream.str();
+    write_number(&message[header_pos], HEADER_SIZE, message.size() - header_pos - HEADER_SIZE);
+#else
+    message[header_pos + HEADER_SIZE] = class_id;
+
+    // set object data (serialize)
+    binary_oarchive archive(message);
+    archive << object;
 
-    // set class id
-    std::ostringstream class_id_stream;
-    class_id_stream << std::setw(CLASS_ID_SIZE) << std::to_string(class_id);
-    const std::string& class_id_str = class_id_stream.str();
+    // set object data size
+    uint32_t body_size = message.size() - header_pos - HEADER_SIZE;
+    for (int i = 0; i < HEADER_SIZE; i++)
+      message[header_pos + i] = static_cast<uint8_t>(body_size >> (8 * i));
+#endif
+  }
 
-    // set message header
-    message.insert(message.end(), header_str.begin(), header_str.end());
+  // builds a message once into a pooled buffer, to be shared by all writes of it
+  template <typename T>
+  message_buffer make_message(const T& object) {
+    writable_buffer buffer = buffer_pool::get_default().acquire();
+    build_message(buffer->data, object);
+    return buffer;
+  }
 
-    // set message body
-    message.insert(message.end(), class_id_str.begin(), class_id_str.end());
-    message.insert(message.end(), object_str.begin(), object_str.end());
+  // returns false if the peer is too far behind, see outbound_queue
+  bool write_data(const message_buffer& data, outbound_queue& queue, bool replaceable = false) {
+    return queue.push(data, replaceable);
   }
 
-  void write_data(const std::vector<uint8_t>& data, boost::asio::ip::tcp::socket& socket) {
-    boost::asio::async_write(socket,
-        boost::asio::buffer(data, data.size()),
-        [](boost::system::error_code, std::size_t){ /* do nothing */ });
+  template <typename T>
+  bool write_object(const T& object, outbound_queue& queue) {
+    return write_data(make_message(object), queue);
   }
 
+  // queues an object as reliable message on a udp channel
   template <typename T>
-  void write_object(uint8_t class_id, const T& object, boost::asio::ip::tcp::socket& socket) {
+  void write_reliable(const T& object, reliable_channel& channel) {
     std::vector<uint8_t> data;
-    build_message(data, class_id, object);
-    write_data(data, socket);
+    build_message(data, object);
+    channel.send_reliable(std::vector<uint8_t>(data.begin() + HEADER_SIZE, data.end()));
   }
 
-  int get_number(const std::vector<uint8_t>& data, size_t start, size_t size) {
-    try {
-      return std::stoi(std::string(data.begin() + start, data.begin() + size));
-    } catch (std::exception& e) {
-      return 0;
+  // sends a frame over tcp, returns false if the peer is too far behind
+  bool write_frame(const frame& data, outbound_queue& queue) {
+    bool ok = true;
+
+    for (auto& m : data.get_messages())
+      ok = queue.push(m) && ok;
+
+    return ok;
+  }
+
+  // a plain socket of a client sends at once, gathering from the buffers
+  void send_packet(const message_buffer& header, const frame& data,
+      boost::asio::ip::udp::socket& socket, const boost::asio::ip::udp::endpoint& endpoint) {
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(1 + data.get_messages().size());
+    buffers.push_back(boost::asio::buffer(header->data));
+    data.get_buffers(buffers);
+
+    boost::system::error_code error;
+    socket.send_to(buffers, endpoint, 0, error);
+
+    if (error)
+      DEBUG("send_to(): " << error.message());
+  }
+
+  // the socket of the server queues the packet until it is flushed
+  void send_packet(const message_buffer& header, const frame& data, datagram_socket& socket,
+      const boost::asio::ip::udp::endpoint& endpoint) {
+    socket.send_to(header, data, endpoint);
+  }
+
+  // sends one packet with due reliable messages followed by the messages of a frame, which are
+  // gathered from their buffers as built
+  template <typename Socket>
+  void write_packet(const frame& data, uint32_t token, reliable_channel& channel,
+      Socket& socket, const boost::asio::ip::udp::endpoint& endpoint) {
+    writable_buffer header = buffer_pool::get_default().acquire();
+    channel.write_packet(header->data, token, data.size(), misc::get_time_ms());
+    send_packet(header, data, socket, endpoint);
+  }
+
+  template <typename T, typename Socket>
+  void write_object(const T& object, uint32_t token, reliable_channel& channel,
+      Socket& socket, const boost::asio::ip::udp::endpoint& endpoint) {
+    frame data;
+    data.add(make_message(object));
+    write_packet(data, token, channel, socket, endpoint);
+  }
+
+  // sends an object from the strand of a connection, as reliable udp message to clients using
+  // udp only
+  template <typename T>
+  void send_object(connection_ptr connection, const T& object, datagram_socket& udp_socket) {
+    connection->strand.post([connection, object, &udp_socket]() {
+      if (connection->udp_only) {
+        write_reliable(object, connection->channel);
+        write_packet(frame(), connection->udp_token, connection->channel, udp_socket,
+            connection->udp_endpoint);
+        udp_socket.flush();
+      } else {
+        write_object(object, *connection->write_queue);
+      }
+    });
+  }
+
+#if _TEXT_ARCHIVE
+  int get_number(const uint8_t* data, size_t size) {
+    int number = 0;
+
+    for (size_t i = 0; i < size; i++) {
+      if (data[i] >= '0' && data[i] <= '9')
+        number = number * 10 + (data[i] - '0');
+      else if (data[i] != ' ' || number)
+        return 0;
     }
+
+    return number;
+  }
+
+  uint8_t get_class_id(const message_body& body) {
+    return body.size < CLASS_ID_SIZE ? 0 : get_number(body.data, CLASS_ID_SIZE);
+  }
+
+  uint32_t get_body_size(const uint8_t* header_data) {
+    return get_number(header_data, HEADER_SIZE);
   }
+#else
+  uint8_t get_class_id(const message_body& body) {
+    return body.size ? body.data[0] : 0;
+  }
+
+  uint32_t get_body_size(const uint8_t* header_data) {
+    uint32_t body_size = 0;
+    for (int i = 0; i < HEADER_SIZE; i++)
+      body_size |= static_cast<uint32_t>(header_data[i]) << (8 * i);
+
+    return body_size;
+  }
+#endif
+
+  // calls handler with the body of every complete message in data, returns bytes used
+  template <typename Handler>
+  size_t read_messages(const uint8_t* data, size_t size, Handler handler) {
+    size_t pos = 0;
+
+    while (size - pos >= HEADER_SIZE) {
+      size_t body_size = get_body_size(data + pos);
+
+      if (size - pos - HEADER_SIZE < body_size)
+        break;
 
-  uint8_t get_class_id(const std::vector<uint8_t>& body_data) {
-    return get_number(body_data, 0, CLASS_ID_SIZE);
+      handler(message_body(data + pos + HEADER_SIZE, body_size));
+      pos += HEADER_SIZE + body_size;
+    }
+
+    return pos;
   }
 
-  int get_body_size(const std::vector<uint8_t>& header_data) {
-    return get_number(header_data, 0, HEADER_SIZE);
+  // handles all complete messages received on a stream, keeps a trailing incomplete one. returns
+  // false if a message is larger than the reader accepts, which is known from its header.
+  template <typename Handler>
+  bool read_messages(stream_reader& reader, Handler handler) {
+    while (reader.size() >= HEADER_SIZE) {
+      size_t frame_size = HEADER_SIZE + static_cast<size_t>(get_body_size(reader.data()));
+
+      if (frame_size > reader.get_max_frame_size())
+        return false;
+
+      if (reader.size() < frame_size)
+        break;
+
+      handler(message_body(reader.data() + HEADER_SIZE, frame_size - HEADER_SIZE));
+      reader.consume(frame_size);
+    }
+
+    return true;
   }
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // Decodes a received body into the type of its class id and passes it to handler, as
+  // handler(object, body), where object may be modified. Types are looked up in a table indexed
+  // by class id, with one decoder instantiated per type in List.
+  //
+
+  template <typename List, typename Handler>
+  class message_dispatcher {
+  public:
+    static_assert(!has_duplicate_class_ids<List>::value, "error, duplicate message class id");
+
+    // returns false if the class id is not in List or the body does not decode into its type
+    static bool dispatch(const message_body& body, Handler& handler) {
+      decoder d = get_table()[get_class_id(body)];
+      return d && d(body, handler);
+    }
+
+  private:
+    using decoder = bool (*)(const message_body&, Handler&);
+    using table = std::array<decoder, 256>;
+
+    template <typename T>
+    static bool decode(const message_body& body, Handler& handler) {
+      T object;
+
+      if (!try_deserialize(object, body))
+        return false;
+
+      handler(object, body);
+      return true;
+    }
+
+    static void add_decoders(table&, message_list<>) {
+    }
+
+    template <typename Head, typename... Tail>
+    static void add_decoders(table& decoders, message_list<Head, Tail...>) {
+      decoders[Head::CLASS_ID] = &decode<Head>;
+      add_decoders(decoders, message_list<Tail...>());
+    }
+
+    static table make_table() {
+      table decoders;
+      decoders.fill(nullptr);
+      add_decoders(decoders, List());
+      return decoders;
+    }
+
+    static const table& get_table() {
+      static const table decoders = make_table();
+      return decoders;
+    }
+  };
 }
 
 #endif // NETWORK_HPP_
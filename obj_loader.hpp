@@ -0,0 +1,72 @@
+#ifndef OBJ_LOADER_HPP_
+#define OBJ_LOADER_HPP_
+
+#include <fstream>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include "misc.hpp"
+
+// reads triangle meshes from wavefront obj data, without depending on a graphics library
+namespace obj_loader {
+  // appends vertex positions and normals of every face corner, faces given as "f 1//1 2//2 4//3"
+  void get_geometry_data(std::istream& stream, std::vector<float>& vertices,
+      std::vector<float>& normals) {
+    std::vector<std::string> vertex_lines, normal_lines;
+
+    while (stream.good()) {
+      std::string line;
+      getline(stream, line);
+
+      // read all strings holding vertices and normals
+      if (line[0] == 'v') {
+        if (line[1] == 'n')
+          normal_lines.push_back(line);
+        else
+          vertex_lines.push_back(line);
+
+        continue;
+      }
+
+      // read strings holding faces and put there values into argument vectors
+      if (line[0] == 'f') {
+        std::vector<std::string> edges;
+        boost::split(edges, line, boost::is_any_of(" ")); // split "f 1//1 2//2 4//3"
+
+        for (size_t i = 1; i < edges.size(); i++) {
+          std::vector<std::string> indices;
+          boost::split(indices, edges[i], boost::is_any_of("/")); // split "1//1"
+
+          float temp;
+
+          std::istringstream vertex_stream(vertex_lines[stoi(indices[0]) - 1]);
+          vertex_stream.ignore(32, ' '); // skip "v"
+          while (vertex_stream >> temp)
+            vertices.push_back(temp);
+
+          std::istringstream normal_stream(normal_lines[stoi(indices[2]) - 1]);
+          normal_stream.ignore(32, ' '); // skip "vn"
+          while (normal_stream >> temp)
+            normals.push_back(temp);
+        }
+      }
+    }
+  }
+
+  bool get_geometry_data_from_file(const char* file, std::vector<float>& vertices,
+      std::vector<float>& normals) {
+    std::ifstream file_stream(file);
+
+    if (!file_stream.is_open()) {
+      INFO("error, could not open file: " << file);
+      return false;
+    }
+
+    get_geometry_data(file_stream, vertices, normals);
+    return true;
+  }
+}
+
+#endif // OBJ_LOADER_HPP_
@@ -0,0 +1,175 @@
+#ifndef OUTBOUND_QUEUE_HPP_
+#define OUTBOUND_QUEUE_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+#include "message_buffer.hpp"
+#include "misc.hpp"
+
+namespace network {
+  // when a peer is too far behind it should be disconnected
+  struct write_limits {
+    size_t max_queued_bytes;
+    size_t max_gathered_messages; // per write
+    uint64_t max_delay_ms; // for the oldest message not yet written
+
+    write_limits()
+      : max_queued_bytes(256 * 1024),
+        max_gathered_messages(64),
+        max_delay_ms(2000)
+    {
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // Messages to one tcp socket. Only one gathered write is in flight at a time, so messages never
+  // interleave. A replaceable message (a snapshot) that is still queued when a newer one arrives
+  // is dropped. Writes are started and completed on the strand that reads and closes the socket,
+  // while messages may be pushed from any thread. Posted handlers keep the queue alive, but not
+  // the owner of strand and socket, which closes the queue before they are destroyed.
+  //
+
+  class outbound_queue : public std::enable_shared_from_this<outbound_queue> {
+  public:
+    outbound_queue(boost::asio::io_service::strand& strand, boost::asio::ip::tcp::socket& socket,
+        const write_limits& limits)
+      : strand_(strand),
+        socket_(socket),
+        limits_(limits),
+        queued_bytes_(0),
+        write_count_(0),
+        writing_(false),
+        failed_(false),
+        closed_(false)
+    {
+    }
+
+    // returns false if the peer is too far behind, the message is queued anyway
+    bool push(const message_buffer& data, bool replaceable = false) {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (replaceable)
+        drop_replaceable();
+
+      queued_message m;
+      m.data = data;
+      m.replaceable = replaceable;
+      m.queued_ms = misc::get_time_ms();
+      queue_.push_back(m);
+      queued_bytes_ += data->data.size();
+
+      if (!writing_) {
+        writing_ = true;
+
+        auto self = shared_from_this();
+        strand_.post([self]() {
+          std::lock_guard<std::mutex> lock(self->mutex_);
+          self->start_write();
+        });
+      }
+
+      return !overloaded(m.queued_ms);
+    }
+
+    // called before strand and socket are destroyed, pending handlers then leave them alone
+    void close() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+
+    // true if a write has failed or the peer is too far behind
+    bool is_overloaded() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return overloaded(misc::get_time_ms());
+    }
+
+  private:
+    struct queued_message {
+      message_buffer data;
+      bool replaceable;
+      uint64_t queued_ms;
+    };
+
+    bool overloaded(uint64_t now_ms) const {
+      return failed_
+          || queued_bytes_ > limits_.max_queued_bytes
+          || (queue_.size() && now_ms - queue_.front().queued_ms > limits_.max_delay_ms);
+    }
+
+    void drop_replaceable() {
+      // first messages are being written when a write is in flight, none before it has started
+      auto i = queue_.begin() + write_count_;
+
+      while (i != queue_.end()) {
+        if (i->replaceable) {
+          queued_bytes_ -= i->data->data.size();
+          i = queue_.erase(i);
+        } else {
+          i++;
+        }
+      }
+    }
+
+    // on the strand, with mutex_ held
+    void start_write() {
+      if (failed_ || closed_ || queue_.empty()) {
+        writing_ = false;
+        return;
+      }
+
+      write_count_ = std::min(queue_.size(), limits_.max_gathered_messages);
+      buffers_.clear();
+
+      for (size_t i = 0; i < write_count_; i++)
+        buffers_.push_back(boost::asio::buffer(queue_[i].data->data));
+
+      auto self = shared_from_this();
+      boost::asio::async_write(socket_, buffers_,
+          strand_.wrap([self](const boost::system::error_code& error, std::size_t) {
+            self->handle_write(error);
+          }));
+    }
+
+    void handle_write(const boost::system::error_code& error) {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (error) {
+        failed_ = true;
+        write_count_ = 0;
+        writing_ = false;
+        DEBUG("async_write(): " << error.message());
+        return;
+      }
+
+      for (size_t i = 0; i < write_count_; i++) {
+        queued_bytes_ -= queue_.front().data->data.size();
+        queue_.pop_front();
+      }
+
+      write_count_ = 0;
+      start_write();
+    }
+
+    boost::asio::io_service::strand& strand_;
+    boost::asio::ip::tcp::socket& socket_;
+    write_limits limits_;
+    std::mutex mutex_;
+    std::deque<queued_message> queue_;
+    std::vector<boost::asio::const_buffer> buffers_;
+    size_t queued_bytes_;
+    size_t write_count_; // messages in the write in flight, at the front of queue
+    bool writing_; // a write is in flight or about to start on the strand
+    bool failed_;
+    bool closed_;
+  };
+
+  using outbound_queue_ptr = std::shared_ptr<outbound_queue>;
+}
+
+#endif // OUTBOUND_QUEUE_HPP_
@@ -4,14 +4,14 @@
 #include <cstdint>
 #include <boost/serialization/access.hpp>
 #include "command.hpp"
-#include "keyboard.hpp"
+#include "movement.hpp"
 
 class player {
 public:
   static const uint8_t CLASS_ID = 1;
 
-  static const int DEFAULT_MOVE_SPEED = 2; // m/s
-  static const int DEFAULT_TURN_SPEED = 3; // rad/s
+  static const int DEFAULT_MOVE_SPEED = movement::MOVE_SPEED; // m/s
+  static const int DEFAULT_TURN_SPEED = movement::TURN_SPEED; // rad/s
 
   player()
     : id_(0),
@@ -25,11 +25,11 @@ public:
   {
   }
 
-  uint8_t get_id() const {
+  uint16_t get_id() const {
     return id_;
   }
 
-  void set_id(uint8_t id) {
+  void set_id(uint16_t id) {
     id_ = id;
   }
 
@@ -89,54 +89,13 @@ public:
     last_command_id_ = command_id;
   }
 
+  // the same movement as the batches of the server tick, see movement::batch
   void run_command(const command& cmd) {
     // remember this command
     last_command_id_ = cmd.id;
 
-    // update angels
-    horz_angel_ += cmd.horz_delta_angel;
-    vert_angel_ += cmd.vert_delta_angel;
-
-    // handle action turn left and turn right
-    if ((cmd.buttons & keyboard::button::left) || (cmd.buttons & keyboard::button::right)) {
-      float add_angel = cmd.duration_ms * DEFAULT_TURN_SPEED / 1000.0;
-
-      horz_angel_ += (cmd.buttons & keyboard::button::left) ? add_angel : -add_angel;
-    }
-
-    // if no more actions except turn left and right then return
-    if (cmd.buttons == (keyboard::button::left | keyboard::button::right))
-      return;
-
-    float add_x, add_z;
-    float base_distance = cmd.duration_ms * DEFAULT_MOVE_SPEED / 1000.0;
-
-    // handle action move forward and move backward
-    if ((cmd.buttons & keyboard::button::forward) || (cmd.buttons & keyboard::button::backward)) {
-      add_x = base_distance *  std::cos(horz_angel_);
-      add_z = base_distance * -std::sin(horz_angel_);
-
-      x_ += (cmd.buttons & keyboard::button::forward) ? add_x : -add_x;
-      z_ += (cmd.buttons & keyboard::button::forward) ? add_z : -add_z;
-    }
-
-    // handle action strafe left and strafe right
-    if ((cmd.buttons & keyboard::button::step_left) ||
-        (cmd.buttons & keyboard::button::step_right)) {
-      add_x = base_distance *  std::cos(horz_angel_ - M_PI / 2);
-      add_z = base_distance * -std::sin(horz_angel_ - M_PI / 2);
-
-      x_ += (cmd.buttons & keyboard::button::step_right) ? add_x : -add_x;
-      z_ += (cmd.buttons & keyboard::button::step_right) ? add_z : -add_z;
-    }
-
-    // handle action move up
-    if ((cmd.buttons & keyboard::button::up))
-      y_ += base_distance;
-
-    // handle action move down
-    if ((cmd.buttons & keyboard::button::down))
-      y_ -= base_distance;
+    movement::apply_command(cmd.buttons, cmd.horz_delta_angel, cmd.vert_delta_angel,
+        cmd.duration_ms, x_, y_, z_, horz_angel_, vert_angel_);
   }
 
 private:
@@ -151,7 +110,7 @@ private:
     ar & last_command_id_;
   }
 
-  uint8_t id_;
+  uint16_t id_; // see slot_map
   uint32_t color_;
   float x_, y_, z_;
   float horz_angel_, vert_angel_;
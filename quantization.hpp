@@ -0,0 +1,49 @@
+#ifndef QUANTIZATION_HPP_
+#define QUANTIZATION_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+//
+// Player state is sent as small integers on a fixed grid. Only the values written to the network
+// are snapped, the simulation keeps full precision so that turns and moves smaller than a step
+// still add up over many commands.
+//
+
+namespace quantization {
+  const int POSITION_LIMIT = 64; // meter, positions are clamped to [-limit, limit)
+  const int POSITION_STEPS_PER_METER = 512;
+  const int POSITION_BITS = 16;
+  const int ANGEL_BITS = 12;
+
+  uint32_t position_to_int(float position) {
+    const int max = (1 << POSITION_BITS) - 1;
+    int value = std::lround((position + POSITION_LIMIT) * POSITION_STEPS_PER_METER);
+
+    return std::min(std::max(value, 0), max);
+  }
+
+  float int_to_position(uint32_t value) {
+    return static_cast<float>(value) / POSITION_STEPS_PER_METER - POSITION_LIMIT;
+  }
+
+  // wraps angel into [-pi, pi)
+  uint32_t angel_to_int(float angel) {
+    const double steps = 1 << ANGEL_BITS;
+    long value = std::lround((angel + M_PI) / (2 * M_PI) * steps);
+
+    return static_cast<uint32_t>(value) & ((1 << ANGEL_BITS) - 1);
+  }
+
+  float int_to_angel(uint32_t value) {
+    return static_cast<float>(value * (2 * M_PI) / (1 << ANGEL_BITS) - M_PI);
+  }
+
+  // shortest signed difference between two angels
+  float angel_difference(float from, float to) {
+    return std::remainder(to - from, static_cast<float>(2 * M_PI));
+  }
+}
+
+#endif // QUANTIZATION_HPP_
@@ -0,0 +1,345 @@
+#ifndef RELIABLE_CHANNEL_HPP_
+#define RELIABLE_CHANNEL_HPP_
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace network {
+  const int PACKET_HEADER_SIZE = 17; // bytes
+  const size_t MAX_PACKET_SIZE = 1200; // bytes, larger snapshots are sent over tcp
+
+  // true if sequence a is more recent than b, allowing for wrap-around
+  bool sequence_is_newer(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) > 0;
+  }
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // A packet is the header, then reliable message count times [id, size, body], then zero or
+  // more unreliable messages that fill the rest of the datagram, each with its tcp message
+  // header. A body is a class id followed by object data, as in a tcp message.
+  //
+
+  class packet_header {
+  public:
+    uint32_t token; // identifies a client joined over tcp, 0 otherwise
+    uint32_t sequence; // increased for every packet sent in one direction
+    uint32_t ack; // most recent sequence received from peer
+    uint32_t ack_bits; // bit n set if sequence ack - 1 - n was received
+    uint8_t reliable_count;
+
+    packet_header()
+      : token(0),
+        sequence(0),
+        ack(0),
+        ack_bits(0),
+        reliable_count(0)
+    {
+    }
+
+    void write(uint8_t* data) const {
+      write_uint32(data, token);
+      write_uint32(data + 4, sequence);
+      write_uint32(data + 8, ack);
+      write_uint32(data + 12, ack_bits);
+      data[16] = reliable_count;
+    }
+
+    bool read(const uint8_t* data, size_t size) {
+      if (size < PACKET_HEADER_SIZE)
+        return false;
+
+      token = read_uint32(data);
+      sequence = read_uint32(data + 4);
+      ack = read_uint32(data + 8);
+      ack_bits = read_uint32(data + 12);
+      reliable_count = data[16];
+
+      return true;
+    }
+
+  private:
+    static void write_uint32(uint8_t* data, uint32_t value) {
+      for (int i = 0; i < 4; i++)
+        data[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+
+    static uint32_t read_uint32(const uint8_t* data) {
+      uint32_t value = 0;
+      for (int i = 0; i < 4; i++)
+        value |= static_cast<uint32_t>(data[i]) << (8 * i);
+      return value;
+    }
+  };
+
+  ///////////////////////////////////////////////////////////////////
+
+  //
+  // Sequencing, acks and reliable-ordered messages for one peer. Every packet acks the last 33
+  // packets received. Reliable messages are resent only when a packet carrying them is known to
+  // be lost: three newer packets have been acked, or it fell out of the ack window. If no acks
+  // arrive at all, they are resent after a timeout.
+  //
+
+  class reliable_channel {
+  public:
+    static const uint32_t LOSS_THRESHOLD = 3; // newer acked packets before a packet counts as lost
+    static const int RESEND_TIMEOUT_MS = 500;
+    static const int RECEIVE_WINDOW = 1024; // reliable messages buffered out of order
+    static const size_t MAX_RECEIVED_SIZE = 33 * MAX_PACKET_SIZE; // bytes buffered out of order
+
+    reliable_channel()
+      : local_sequence_(0),
+        remote_sequence_(0),
+        received_bits_(0),
+        next_send_id_(0),
+        next_receive_id_(0),
+        rtt_ms_(0),
+        received_size_(0),
+        failed_(false)
+    {
+    }
+
+    // queues a message body (class id and object data) for reliable, ordered delivery
+    void send_reliable(const std::vector<uint8_t>& body) {
+      pending_message m;
+      m.id = next_send_id_++;
+      m.body = body;
+      m.in_flight = false;
+      m.sent_ms = 0;
+      pending_.push_back(m);
+    }
+
+    // true if a queued reliable message is due to be sent
+    bool has_messages_to_send(uint64_t now_ms) const {
+      for (const pending_message& m : pending_)
+        if (!m.in_flight || now_ms - m.sent_ms > RESEND_TIMEOUT_MS)
+          return true;
+
+      return false;
+    }
+
+    // writes packet header and due reliable messages, leaving room for unreliable messages
+    void write_packet(std::vector<uint8_t>& data, uint32_t token, size_t unreliable_size,
+        uint64_t now_ms) {
+      packet_header header;
+      header.token = token;
+      header.sequence = ++local_sequence_;
+      header.ack = remote_sequence_;
+      header.ack_bits = received_bits_;
+
+      size_t header_pos = data.size();
+      data.resize(header_pos + PACKET_HEADER_SIZE);
+
+      sent_packet p;
+      p.sequence = header.sequence;
+
+      for (pending_message& m : pending_) {
+        if (header.reliable_count == 255)
+          break;
+
+        if (m.in_flight && now_ms - m.sent_ms <= RESEND_TIMEOUT_MS)
+          continue;
+
+        size_t packet_size = data.size() - header_pos + 4 + m.body.size() + unreliable_size;
+        if (packet_size > MAX_PACKET_SIZE && header.reliable_count)
+          break;
+
+        data.push_back(static_cast<uint8_t>(m.id));
+        data.push_back(static_cast<uint8_t>(m.id >> 8));
+        data.push_back(static_cast<uint8_t>(m.body.size()));
+        data.push_back(static_cast<uint8_t>(m.body.size() >> 8));
+        data.insert(data.end(), m.body.begin(), m.body.end());
+
+        m.in_flight = true;
+        m.sent_ms = now_ms;
+        p.message_ids.push_back(m.id);
+        header.reliable_count++;
+      }
+
+      header.write(&data[header_pos]);
+
+      if (p.message_ids.size())
+        sent_packets_.push_back(p);
+
+      sent_time& t = sent_times_[header.sequence % sent_times_.size()];
+      t.sequence = header.sequence;
+      t.time_ms = now_ms;
+    }
+
+    // processes acks and reliable messages of a received packet, appends reliable messages that
+    // are now in order to messages. returns the position of unreliable messages, or 0 if the
+    // packet is invalid, a duplicate, or older than a packet already received (stale). a peer
+    // whose reliable messages exceed MAX_RECEIVED_SIZE out of order fails the channel, as they
+    // are acked and would not be sent again.
+    size_t read_packet(const packet_header& header, const uint8_t* data, size_t size,
+        uint64_t now_ms, std::vector<std::vector<uint8_t>>& messages) {
+      size_t pos = PACKET_HEADER_SIZE;
+
+      if (failed_)
+        return 0;
+
+      // check sequence, drop duplicates
+      bool newest = !remote_sequence_ || sequence_is_newer(header.sequence, remote_sequence_);
+
+      if (newest) {
+        uint32_t shift = remote_sequence_ ? header.sequence - remote_sequence_ : 0;
+        received_bits_ = shift >= 32 ? 0 : received_bits_ << shift;
+        if (remote_sequence_ && shift <= 32)
+          received_bits_ |= uint32_t(1) << (shift - 1);
+        remote_sequence_ = header.sequence;
+      } else {
+        uint32_t age = remote_sequence_ - header.sequence;
+        if (!age || (age <= 32 && (received_bits_ & (uint32_t(1) << (age - 1)))))
+          return 0;
+        if (age <= 32)
+          received_bits_ |= uint32_t(1) << (age - 1);
+      }
+
+      process_acks(header.ack, header.ack_bits, now_ms);
+
+      // read reliable messages
+      for (int i = 0; i < header.reliable_count; i++) {
+        if (size - pos < 4)
+          return 0;
+
+        uint16_t id = data[pos] | (data[pos + 1] << 8);
+        size_t body_size = data[pos + 2] | (data[pos + 3] << 8);
+        pos += 4;
+
+        if (size - pos < body_size)
+          return 0;
+
+        int16_t distance = static_cast<int16_t>(id - next_receive_id_);
+        if (distance >= 0 && distance < RECEIVE_WINDOW && !received_.count(id)) {
+          if (distance && received_size_ + body_size > MAX_RECEIVED_SIZE) {
+            failed_ = true;
+            return 0;
+          }
+
+          received_[id] = std::vector<uint8_t>(data + pos, data + pos + body_size);
+          received_size_ += body_size;
+        }
+
+        pos += body_size;
+      }
+
+      // deliver messages in order
+      auto i = received_.find(next_receive_id_);
+      while (i != received_.end()) {
+        received_size_ -= i->second.size();
+        messages.push_back(std::move(i->second));
+        received_.erase(i);
+        i = received_.find(++next_receive_id_);
+      }
+
+      return newest ? pos : 0;
+    }
+
+    // true once the peer sent more out of order than is buffered, nothing is read afterwards
+    bool is_failed() const {
+      return failed_;
+    }
+
+    // smoothed round trip time
+    uint32_t get_rtt_ms() const {
+      return rtt_ms_;
+    }
+
+  private:
+    struct pending_message {
+      uint16_t id;
+      std::vector<uint8_t> body;
+      bool in_flight;
+      uint64_t sent_ms;
+    };
+
+    struct sent_packet {
+      uint32_t sequence;
+      std::vector<uint16_t> message_ids;
+    };
+
+    struct sent_time {
+      uint32_t sequence;
+      uint64_t time_ms;
+
+      sent_time()
+        : sequence(0),
+          time_ms(0)
+      {
+      }
+    };
+
+    void process_acks(uint32_t ack, uint32_t ack_bits, uint64_t now_ms) {
+      if (!ack)
+        return;
+
+      // measure round trip time on the most recent ack
+      sent_time& t = sent_times_[ack % sent_times_.size()];
+      if (t.sequence == ack) {
+        uint32_t sample = now_ms - t.time_ms;
+        rtt_ms_ = rtt_ms_ ? (rtt_ms_ * 7 + sample) / 8 : sample;
+        t.sequence = 0;
+      }
+
+      auto p = sent_packets_.begin();
+
+      while (p != sent_packets_.end()) {
+        if (sequence_is_newer(p->sequence, ack)) {
+          p++;
+          continue;
+        }
+
+        uint32_t age = ack - p->sequence;
+        bool acked = !age || (age <= 32 && (ack_bits & (uint32_t(1) << (age - 1))));
+
+        if (acked) {
+          for (uint16_t id : p->message_ids)
+            remove_pending(id);
+        } else if (age >= LOSS_THRESHOLD) {
+          for (uint16_t id : p->message_ids)
+            mark_lost(id);
+        } else {
+          p++;
+          continue;
+        }
+
+        p = sent_packets_.erase(p);
+      }
+    }
+
+    void remove_pending(uint16_t id) {
+      for (auto i = pending_.begin(); i != pending_.end(); i++) {
+        if (i->id == id) {
+          pending_.erase(i);
+          break;
+        }
+      }
+    }
+
+    void mark_lost(uint16_t id) {
+      for (pending_message& m : pending_)
+        if (m.id == id)
+          m.in_flight = false;
+    }
+
+    uint32_t local_sequence_;
+    uint32_t remote_sequence_;
+    uint32_t received_bits_;
+    uint16_t next_send_id_;
+    uint16_t next_receive_id_;
+    uint32_t rtt_ms_;
+    std::list<pending_message> pending_;
+    std::list<sent_packet> sent_packets_; // packets with reliable messages, not yet acked
+    std::array<sent_time, 256> sent_times_;
+    std::map<uint16_t, std::vector<uint8_t>> received_; // reliable messages out of order
+    size_t received_size_; // bytes, bodies in received_
+    bool failed_;
+  };
+}
+
+#endif // RELIABLE_CHANNEL_HPP_
@@ -3,114 +3,429 @@
 
 #include <cstdint>
 #include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include "misc.hpp"
 #include "network.hpp"
-#include "world.hpp"
+#include "server_config.hpp"
+#include "world_instance.hpp"
+
+//
+// Hosts many world instances, one per room joined. Handlers run on a pool of io threads: the
+// control strand accepts clients, routes udp datagrams and places joining players into rooms,
+// while reading, decoding and snapshot encoding of a connection run on the strand of the
+// connection, see network::connection. Instances simulate on worker threads pinned to one cpu
+// each, a new instance goes to the worker with the least measured tick cost.
+//
 
 class server {
 public:
-  static const int CLIENT_UPDATE_INTERVAL_MS = 50;
+  static const int TIMEOUT_CHECK_INTERVAL_MS = 1000;
+  static const int IO_REPORT_INTERVAL_MS = 5000;
 
-  server(int port)
-    : game_time_ms_(0),
+  server(int port, const server_config& config = server_config())
+    : config_(config),
       io_service_(),
       endpoint_(boost::asio::ip::tcp::v4(), port),
       acceptor_(io_service_, endpoint_),
-      timer_(io_service_)
+      control_(io_service_),
+      timeout_timer_(io_service_),
+      udp_socket_(io_service_,
+          boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port)),
+      io_stats_(udp_socket_.get_stats()),
+      io_report_ms_(misc::get_time_ms()),
+      udp_connection_window_ms_(0),
+      udp_connection_count_(0),
+      stopping_(false)
   {
+    start_workers();
     start_socket_acceptor();
-    start_client_updater();
-    io_service_thread_ = std::thread([this](){ io_service_.run(); });
-    INFO("server started");
+    start_udp_receive();
+    start_timeout_check();
+
+    for (int i = 0; i < config_.io_threads; i++)
+      io_threads_.push_back(std::thread([this](){ io_service_.run(); }));
+
+    INFO("server started, io threads: " << config_.io_threads << ", worker threads: "
+        << config_.worker_threads);
   }
 
   ~server() {
     INFO("stopping server");
     io_service_.stop();
-    io_service_thread_.join();
+
+    for (auto& t : io_threads_)
+      t.join();
+
+    // instances let go of their connections and timers, then workers run out of work
+    for (auto& c : connections_) {
+      std::shared_ptr<world_instance> instance = std::atomic_load(&c->instance);
+      if (instance)
+        instance->post_leave(c);
+    }
+
+    for (auto& r : rooms_)
+      r.second.instance->stop();
+
+    rooms_.clear();
+
+    for (auto& w : workers_) {
+      w->work.reset();
+      w->thread.join();
+    }
+
+    drain();
   }
 
 private:
-  void process_message(network::connection_ptr connection) {
-    switch (network::get_class_id(connection->read_buffer)) {
-      case network::join_request::CLASS_ID:
-        process_join_request(connection);
-        break;
-      case command::CLASS_ID:
-        process_command(connection);
+  // thread running the simulation of the instances placed on it
+  struct worker {
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work; // keeps running without instances
+    std::thread thread;
+
+    worker()
+      : work(new boost::asio::io_service::work(io_service))
+    {
+    }
+  };
+
+  // used on the control strand only
+  struct room {
+    std::shared_ptr<world_instance> instance;
+    size_t worker; // index in workers_
+    int connections; // placed in the room and not yet closed
+  };
+
+  // passes decoded messages of a connection to the post_message overloads
+  class message_handler {
+  public:
+    message_handler(server& s, network::connection_ptr connection)
+      : server_(s),
+        connection_(connection)
+    {
+    }
+
+    template <typename T>
+    void operator()(T& message, const network::message_body& body) {
+      server_.post_message(connection_, message);
+    }
+
+  private:
+    server& server_;
+    network::connection_ptr connection_;
+  };
+
+  using message_dispatcher = network::message_dispatcher<network::client_messages,
+      message_handler>;
+
+  // decoded on the strand of the connection, rooms are chosen on the control strand
+  void post_message(network::connection_ptr connection, const network::join_request& m) {
+    control_.post([this, connection, m]() { join(connection, m); });
+  }
+
+  // commands go straight to the instance of the connection, dropped before it joined
+  void post_message(network::connection_ptr connection, const network::command_batch& m) {
+    std::shared_ptr<world_instance> instance = std::atomic_load(&connection->instance);
+
+    if (instance)
+      instance->post_commands(connection, m);
+  }
+
+  // snapshot state belongs to the connection, acks do not wait for the simulation
+  void post_message(network::connection_ptr connection, const network::snapshot_ack& m) {
+    process_message(connection, m);
+  }
+
+  // returns false if the message is unknown or does not decode, its sender is then dropped
+  bool process_message(network::connection_ptr connection, const network::message_body& body) {
+    message_handler handler(*this, connection);
+
+    if (!message_dispatcher::dispatch(body, handler)) {
+      DEBUG("unknown or invalid message, class id: "
+          << static_cast<int>(network::get_class_id(body)));
+      return false;
+    }
+
+    return true;
+  }
+
+  void process_message(network::connection_ptr connection, const network::snapshot_ack& m) {
+    if (m.sequence <= connection->acked_sequence)
+      return;
+
+    connection->acked_sequence = m.sequence;
+
+    for (const network::sent_snapshot& sent : connection->sent_snapshots) {
+      if (sent.snapshot->sequence == m.sequence) {
+        uint32_t sample = misc::get_time_ms() - sent.sent_ms;
+        uint32_t rtt = connection->rtt_ms;
+        connection->rtt_ms = rtt ? (rtt * 7 + sample) / 8 : sample;
         break;
+      }
     }
   }
 
-  void process_join_request(network::connection_ptr connection) {
-    network::join_request m;
-    network::deserialize(m, connection->read_buffer);
+  // places the player of a connection into the room it asked for, creating the room if needed
+  void join(network::connection_ptr connection, const network::join_request& m) {
+    // already placed, or closed while the request was on its way
+    if (std::atomic_load(&connection->instance)
+        || std::find(connections_.begin(), connections_.end(), connection) == connections_.end())
+      return;
 
-    player p;
-    p.set_color_AABBGGRR(m.player_color_AABBGGRR);
+    auto i = rooms_.find(m.room);
 
-    if (world_.add_player(p)) {
-      connection->player_id = p.get_id();
+    if (i == rooms_.end()) {
+      if (rooms_.size() >= config_.max_instances) {
+        network::server_deny deny;
+        deny.reason = "instance limit reached";
+        network::send_object(connection, deny, udp_socket_);
 
-      // confirm join
-      network::server_accept accept;
-      accept.player_id = p.get_id();
-      network::write_object(network::server_accept::CLASS_ID, accept, connection->socket);
+        INFO("player rejected, reason: " << deny.reason);
+        return;
+      }
 
-      INFO("player joined, id: " << std::to_string(p.get_id()));
-    } else {
-      // reject join
-      network::server_deny deny;
-      deny.reason = "player limit reached";
-      network::write_object(network::server_deny::CLASS_ID, deny, connection->socket);
+      i = rooms_.insert(std::make_pair(m.room, create_room(m.room))).first;
+    }
+
+    i->second.connections++;
+    connection->udp_token = generate_udp_token();
+    udp_connections_[connection->udp_token] = connection;
+
+    i->second.instance->post_join(connection, m);
+    std::atomic_store(&connection->instance, i->second.instance);
+  }
+
+  // instance of a new room, on the worker with the least tick cost, then the fewest rooms
+  room create_room(uint32_t id) {
+    std::vector<uint64_t> cost_us(workers_.size());
+    std::vector<size_t> count(workers_.size());
+
+    for (auto& r : rooms_) {
+      cost_us[r.second.worker] += r.second.instance->get_tick_cost_us();
+      count[r.second.worker]++;
+    }
+
+    size_t best = 0;
+    for (size_t w = 1; w < workers_.size(); w++)
+      if (cost_us[w] < cost_us[best] || (cost_us[w] == cost_us[best] && count[w] < count[best]))
+        best = w;
 
-      INFO("player rejected, reason: " << deny.reason);
+    room r;
+    r.worker = best;
+    r.connections = 0;
+    r.instance = std::make_shared<world_instance>(id, workers_[best]->io_service, udp_socket_,
+        config_, [this](network::connection_ptr c) { post_close_connection(c); });
+    r.instance->start();
+
+    INFO("room created, id: " << id << ", worker: " << best);
+
+    return r;
+  }
+
+  // runs the handlers still queued on the io service, which may hold a flush of udp_socket_
+  // (see world_instance), so none is left to run at its destruction, after the socket's.
+  // nothing new is started: stopping_ ends accepts, reads, timeouts and closes.
+  void drain() {
+    stopping_ = true;
+    udp_socket_.cancel();
+
+    io_service_.restart();
+    while (io_service_.poll())
+      ;
+  }
+
+  void start_workers() {
+    unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 0; i < config_.worker_threads; i++) {
+      workers_.push_back(std::unique_ptr<worker>(new worker()));
+      worker& w = *workers_.back();
+      w.thread = std::thread([&w](){ w.io_service.run(); });
+
+      if (config_.pin_workers && !misc::pin_thread(w.thread, i % cpus))
+        INFO("pinning worker thread failed, cpu: " << i % cpus);
     }
   }
 
-  void process_command(network::connection_ptr connection) {
-    command c;
-    network::deserialize(c, connection->read_buffer);
+  uint32_t generate_udp_token() {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    uint32_t token;
+
+    do {
+      token = gen();
+    } while (!token || udp_connections_.count(token));
+
+    return token;
+  }
+
+  void start_udp_receive() {
+    udp_socket_.start_receive(control_,
+        [this](const uint8_t* data, size_t size, const boost::asio::ip::udp::endpoint& sender) {
+          route_datagram(data, size, sender);
+        });
+  }
+
+  // finds the connection of a datagram, which then handles a copy of it on its strand
+  void route_datagram(const uint8_t* data, size_t size,
+      const boost::asio::ip::udp::endpoint& sender) {
+    if (stopping_)
+      return;
+
+    network::packet_header header;
+    if (!header.read(data, size))
+      return;
+
+    network::connection_ptr connection = get_udp_connection(header, data, size, sender);
+    if (!connection)
+      return;
 
-    //
-    // TODO: validate command
-    //
+    network::writable_buffer datagram = network::buffer_pool::get_default().acquire();
+    datagram->data.assign(data, data + size);
 
-    // simulate
-    world_.run_command(c, connection->player_id);
+    connection->strand.post([this, connection, header, datagram, sender]() {
+      process_datagram(connection, header, datagram->data, sender);
+    });
   }
 
-  void update_clients() {
-    game_time_ms_ += CLIENT_UPDATE_INTERVAL_MS;
+  void process_datagram(network::connection_ptr connection, const network::packet_header& header,
+      const std::vector<uint8_t>& data, const boost::asio::ip::udp::endpoint& sender) {
+    // client has a working udp channel, follow its address
+    if (header.token) {
+      connection->udp_endpoint = sender;
+      connection->udp_bound = true;
+    }
+
+    uint64_t now = misc::get_time_ms();
+    connection->last_receive_ms = now;
+
+    // handle reliable messages, then unreliable messages unless packet is stale. the rest of a
+    // datagram is dropped after an invalid message.
+    std::vector<std::vector<uint8_t>> messages;
+    size_t body_pos = connection->channel.read_packet(header, data.data(), data.size(), now,
+        messages);
 
-    if (!connections_.size())
+    if (connection->channel.is_failed()) {
+      INFO("too many reliable messages out of order, player id: "
+          << std::to_string(connection->player_id));
+      post_close_connection(connection);
       return;
+    }
+
+    for (auto& m : messages)
+      if (!process_message(connection, m))
+        return;
+
+    bool valid = true;
+
+    if (body_pos)
+      network::read_messages(data.data() + body_pos, data.size() - body_pos,
+          [this, connection, &valid](const network::message_body& body) {
+            valid = valid && process_message(connection, body);
+          });
+  }
+
+  // finds client joined over tcp by token, or client using udp only by address. a connection
+  // for a new address is only made for its join request, and no more than
+  // udp_connection_rate per second.
+  network::connection_ptr get_udp_connection(const network::packet_header& header,
+      const uint8_t* data, size_t size, const boost::asio::ip::udp::endpoint& sender) {
+    if (header.token) {
+      auto i = udp_connections_.find(header.token);
+      return i != udp_connections_.end() ? i->second : network::connection_ptr();
+    }
+
+    auto i = udp_only_connections_.find(sender);
+    if (i != udp_only_connections_.end())
+      return i->second;
 
-    // build world snapshot
-    std::vector<uint8_t> data;
-    network::world_snapshot s(world_);
-    s.server_time_ms = game_time_ms_;
-    network::build_message(data, network::world_snapshot::CLASS_ID, s);
+    if (!is_join_packet(header, data, size))
+      return network::connection_ptr();
+
+    uint64_t now = misc::get_time_ms();
+
+    if (now - udp_connection_window_ms_ >= 1000) {
+      udp_connection_window_ms_ = now;
+      udp_connection_count_ = 0;
+    }
+
+    if (udp_connection_count_ >= config_.udp_connection_rate) {
+      DEBUG("udp join dropped, too many new connections");
+      return network::connection_ptr();
+    }
+
+    udp_connection_count_++;
+
+    // new client using udp only
+    network::connection_ptr c(new network::connection(io_service_, config_.write_limits));
+    c->udp_only = true;
+    c->udp_bound = true;
+    c->udp_endpoint = sender;
+    c->last_receive_ms = misc::get_time_ms(); // before its strand handles the first packet
+    connections_.push_back(c);
+    udp_only_connections_[c->udp_endpoint] = c;
+    INFO("new client connected over udp");
+
+    return c;
+  }
+
+  // true if the first reliable message of a packet, as sent by a new channel, is a join request
+  // that decodes, so a malformed packet never gets a connection
+  static bool is_join_packet(const network::packet_header& header, const uint8_t* data,
+      size_t size) {
+    size_t pos = network::PACKET_HEADER_SIZE;
+
+    if (!header.reliable_count || size - pos < 4)
+      return false;
+
+    uint16_t id = data[pos] | (data[pos + 1] << 8);
+    size_t body_size = data[pos + 2] | (data[pos + 3] << 8);
+    pos += 4;
+
+    if (id || size - pos < body_size)
+      return false;
+
+    network::message_body body(data + pos, body_size);
+    network::join_request join;
+    return network::get_class_id(body) == network::join_request::CLASS_ID
+        && network::try_deserialize(join, body);
+  }
 
-    // send to all clients
+  void close_timed_out_connections() {
+    std::vector<network::connection_ptr> timed_out;
+    uint64_t now = misc::get_time_ms();
+
+    // receive time is set on the strand of the connection, it may be just after now
     for (auto& c : connections_)
-      network::write_data(data, c->socket);
+      if (c->udp_only && now > c->last_receive_ms + network::CONNECTION_TIMEOUT_MS)
+        timed_out.push_back(c);
+
+    for (auto& c : timed_out)
+      close_connection(c);
   }
 
   void start_socket_acceptor() {
-    network::connection_ptr c(new network::connection(io_service_));
+    network::connection_ptr c(new network::connection(io_service_, config_.write_limits,
+        config_.max_frame_size));
     acceptor_.async_accept(c->socket,
-        boost::bind(&server::handle_socket_accept, this, c,
-            boost::asio::placeholders::error));
+        control_.wrap(boost::bind(&server::handle_socket_accept, this, c,
+            boost::asio::placeholders::error)));
   }
 
   void handle_socket_accept(network::connection_ptr connection,
       const boost::system::error_code& error) {
+    if (stopping_)
+      return;
+
     if (!error) {
       connections_.push_back(connection);
-      start_read_header(connection);
+      start_read(connection);
       INFO("new client connected");
     } else {
       DEBUG("async_accept(): " << error.message());
@@ -119,94 +434,150 @@ private:
     start_socket_acceptor();
   }
 
-  void start_client_updater() {
-    timer_.expires_from_now(boost::posix_time::milliseconds(CLIENT_UPDATE_INTERVAL_MS));
-    timer_.async_wait(
-      boost::bind(&server::handle_client_update, this, boost::asio::placeholders::error));
+  void start_timeout_check() {
+    timeout_timer_.expires_from_now(
+        boost::posix_time::milliseconds(static_cast<long>(TIMEOUT_CHECK_INTERVAL_MS)));
+    timeout_timer_.async_wait(
+      control_.wrap(boost::bind(&server::handle_timeout_check, this,
+          boost::asio::placeholders::error)));
   }
 
-  void handle_client_update(const boost::system::error_code& error) {
+  void handle_timeout_check(const boost::system::error_code& error) {
+    if (stopping_)
+      return;
+
     if (!error) {
-      update_clients();
-      start_client_updater();
+      close_timed_out_connections();
+      report_io();
+      start_timeout_check();
     } else {
       DEBUG("async_wait(): " << error.message());
     }
   }
 
-  void start_read_header(network::connection_ptr connection) {
-    connection->read_buffer.clear();
-    connection->read_buffer.resize(network::HEADER_SIZE);
+  // udp system calls per tick of the last interval, to see how well datagrams are batched
+  void report_io() {
+    uint64_t now_ms = misc::get_time_ms();
+    if (now_ms - io_report_ms_ < static_cast<uint64_t>(IO_REPORT_INTERVAL_MS))
+      return;
 
-    boost::asio::async_read(connection->socket,
-        boost::asio::buffer(connection->read_buffer, network::HEADER_SIZE),
-        boost::bind(&server::handle_read_header, this, connection,
-            boost::asio::placeholders::error));
-  }
+    network::datagram_stats stats = udp_socket_.get_stats();
+    double ticks = (now_ms - io_report_ms_) * config_.tick_rate / 1000.0;
 
-  void handle_read_header(network::connection_ptr connection,
-      const boost::system::error_code& error) {
-    if (!error) {
-      start_read_body(connection, network::get_body_size(connection->read_buffer));
-    } else {
-      close_connection(connection);
-      DEBUG("async_read(): " << error.message());
-    }
-  }
+    DEBUG("udp io per tick, send calls: " << (stats.send_calls - io_stats_.send_calls) / ticks
+        << ", datagrams sent: " << (stats.datagrams_sent - io_stats_.datagrams_sent) / ticks
+        << ", receive calls: " << (stats.receive_calls - io_stats_.receive_calls) / ticks
+        << ", datagrams received: "
+        << (stats.datagrams_received - io_stats_.datagrams_received) / ticks);
 
-  void start_read_body(network::connection_ptr connection, size_t read_size) {
-    connection->read_buffer.clear();
-    connection->read_buffer.resize(read_size);
+    io_stats_ = stats;
+    io_report_ms_ = now_ms;
+  }
 
-    boost::asio::async_read(connection->socket,
-        boost::asio::buffer(connection->read_buffer, read_size),
-        boost::bind(&server::handle_read_body, this, connection,
-            boost::asio::placeholders::error));
+  void start_read(network::connection_ptr connection) {
+    connection->socket.async_read_some(connection->reader.prepare(),
+        connection->strand.wrap(boost::bind(&server::handle_read, this, connection,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred)));
   }
 
-  void handle_read_body(network::connection_ptr connection,
-      const boost::system::error_code& error) {
+  void handle_read(network::connection_ptr connection, const boost::system::error_code& error,
+      size_t size) {
+    if (stopping_)
+      return;
+
     if (!error) {
-      process_message(connection);
-      start_read_header(connection);
+      // handle every complete message received
+      connection->reader.commit(size);
+      bool decoded = true;
+      bool valid = network::read_messages(connection->reader,
+          [this, connection, &decoded](const network::message_body& body) {
+            decoded = decoded && process_message(connection, body);
+          });
+
+      if (!valid || !decoded) {
+        INFO((valid ? "invalid message" : "message too large") << ", player id: "
+            << std::to_string(connection->player_id));
+        post_close_connection(connection);
+        return;
+      }
+
+      start_read(connection);
     } else {
-      close_connection(connection);
-      DEBUG("async_read(): " << error.message());
+      post_close_connection(connection);
+      DEBUG("async_read_some(): " << error.message());
     }
   }
 
+  // closes connection from its strand
+  void post_close_connection(network::connection_ptr connection) {
+    control_.post([this, connection]() { close_connection(connection); });
+  }
+
   void close_connection(network::connection_ptr connection) {
-    remove_connection_from_list(connection);
-    world_.remove_player(connection->player_id);
-    connection->socket.close();
+    // pending reads fail after close, connection is then already closed
+    if (stopping_ || !remove_connection_from_list(connection))
+      return;
+
+    udp_connections_.erase(connection->udp_token);
+    if (connection->udp_only)
+      udp_only_connections_.erase(connection->udp_endpoint);
+
+    std::shared_ptr<world_instance> instance = std::atomic_load(&connection->instance);
+    if (instance) {
+      instance->post_leave(connection);
+
+      // rooms hold every connection placed in them, the last one closes the room
+      auto i = rooms_.find(instance->get_room());
+      if (--i->second.connections == 0) {
+        instance->stop();
+        rooms_.erase(i);
+        INFO("room closed, id: " << instance->get_room());
+      }
+    }
+
+    connection->strand.post([connection]() { connection->socket.close(); });
     INFO("client disconnected");
   }
 
-  void remove_connection_from_list(network::connection_ptr connection) {
+  bool remove_connection_from_list(network::connection_ptr connection) {
     auto i = connections_.begin();
 
     while (i != connections_.end()) {
       if (i->get() == connection.get()) {
         connections_.erase(i);
-        break;
+        return true;
       }
       i++;
     }
+
+    return false;
   }
 
-  // game
-  world world_;
-  uint64_t game_time_ms_;
+  server_config config_;
+  std::vector<std::unique_ptr<worker>> workers_; // outlive instances held by connections
 
   // network
   boost::asio::io_service io_service_;
   boost::asio::ip::tcp::endpoint endpoint_;
   boost::asio::ip::tcp::acceptor acceptor_;
-  boost::asio::deadline_timer timer_;
+  boost::asio::io_service::strand control_;
+  boost::asio::deadline_timer timeout_timer_;
   std::list<network::connection_ptr> connections_;
+  network::datagram_socket udp_socket_;
+  network::datagram_stats io_stats_; // at the last report
+  uint64_t io_report_ms_;
+  std::map<uint32_t, network::connection_ptr> udp_connections_; // by udp token
+  std::map<boost::asio::ip::udp::endpoint, network::connection_ptr> udp_only_connections_;
+  uint64_t udp_connection_window_ms_; // start of the second new udp connections are counted in
+  size_t udp_connection_count_;
+
+  // rooms by id, instances refer to udp_socket_ and run on workers_
+  std::map<uint32_t, room> rooms_;
+  bool stopping_; // set once io threads and workers are done, see drain
 
   // other
-  std::thread io_service_thread_;
+  std::vector<std::thread> io_threads_;
 };
 
 #endif // SERVER_HPP_
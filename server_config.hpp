@@ -0,0 +1,43 @@
+#ifndef SERVER_CONFIG_HPP_
+#define SERVER_CONFIG_HPP_
+
+#include <algorithm>
+#include <thread>
+#include "network.hpp"
+#include "spatial_grid.hpp"
+#include "world.hpp"
+
+struct server_config {
+  int io_threads; // threads running io handlers, connections are handled in parallel
+  int worker_threads; // threads running the simulation of world instances
+  bool pin_workers; // worker threads are pinned to one cpu each, in order
+  size_t max_instances; // world instances hosted at once, one per room joined
+  int tick_rate; // simulation ticks per second, independent of the snapshot rate
+  int jitter_buffer_ms; // commands of a player wait up to this long to run at an even pace
+  network::write_limits write_limits;
+  interest_area interest;
+  network::snapshot_budget budget;
+  size_t max_frame_size; // bytes, larger messages from clients close the connection
+  size_t udp_connection_rate; // new udp only clients accepted per second, others are dropped
+
+  // past ticks kept to look at the world as a client saw it, must cover round trip plus
+  // interpolation time of clients, memory grows with both
+  int history_ms;
+  size_t history_players;
+
+  server_config()
+    : io_threads(std::max(1u, std::thread::hardware_concurrency())),
+      worker_threads(std::max(1u, std::thread::hardware_concurrency())),
+      pin_workers(true),
+      max_instances(256),
+      tick_rate(60),
+      jitter_buffer_ms(50),
+      max_frame_size(network::MAX_CLIENT_FRAME_SIZE),
+      udp_connection_rate(100),
+      history_ms(1000),
+      history_players(world::MAX_PLAYERS)
+  {
+  }
+};
+
+#endif // SERVER_CONFIG_HPP_
@@ -0,0 +1,49 @@
+#ifndef SLAB_POOL_HPP_
+#define SLAB_POOL_HPP_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace network {
+  using slab = std::unique_ptr<uint8_t[]>;
+
+  //
+  // Fixed-size receive buffers, one pool per thread so that taking and returning a buffer needs
+  // no lock. A buffer returned on another thread joins the pool of that thread.
+  //
+
+  class slab_pool {
+  public:
+    static const size_t MAX_FREE_SLABS = 256; // per slab size
+
+    slab acquire(size_t size) {
+      std::vector<slab>& slabs = free_[size];
+
+      if (slabs.empty())
+        return slab(new uint8_t[size]);
+
+      slab s = std::move(slabs.back());
+      slabs.pop_back();
+      return s;
+    }
+
+    void release(slab s, size_t size) {
+      std::vector<slab>& slabs = free_[size];
+
+      if (slabs.size() < MAX_FREE_SLABS)
+        slabs.push_back(std::move(s));
+    }
+
+    static slab_pool& get_local() {
+      static thread_local slab_pool pool;
+      return pool;
+    }
+
+  private:
+    std::map<size_t, std::vector<slab>> free_; // by slab size
+  };
+}
+
+#endif // SLAB_POOL_HPP_
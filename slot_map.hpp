@@ -0,0 +1,180 @@
+#ifndef SLOT_MAP_HPP_
+#define SLOT_MAP_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+//
+// Values by 16-bit handle with constant time insert, lookup and erase. The low SLOT_BITS of a
+// handle select a slot, the high bits are the generation of the slot, counted up whenever the
+// slot is taken again, so a handle kept after its value was erased does not find the next value
+// in that slot. Values are kept dense in insertion order, except that erase moves the last value
+// into the gap. Handle 0 is never issued.
+//
+
+template <typename T>
+class slot_map {
+public:
+  static const int SLOT_BITS = 11;
+  static const int GENERATION_BITS = 16 - SLOT_BITS;
+  static const size_t MAX_SIZE = 1 << SLOT_BITS;
+
+  // freed slots are reused once this many are waiting, so a handle repeats only after many
+  // other values were erased
+  static const size_t MIN_FREE_SLOTS = 32;
+
+  // returns the handle of the new value, 0 if full
+  uint16_t insert(const T& value) {
+    uint32_t s;
+
+    // slots taken by assign since they were freed
+    while (free_slots_.size() && slots_[free_slots_.front()].index >= 0)
+      free_slots_.pop_front();
+
+    if (free_slots_.size() && (free_slots_.size() >= MIN_FREE_SLOTS
+        || slots_.size() == MAX_SIZE)) {
+      s = free_slots_.front();
+      free_slots_.pop_front();
+    } else if (slots_.size() < MAX_SIZE) {
+      s = slots_.size();
+      slots_.push_back(slot());
+    } else {
+      return 0;
+    }
+
+    uint16_t handle = make_handle(s, next_generation(get_generation(slots_[s].handle)));
+    slots_[s].handle = handle;
+    slots_[s].index = values_.size();
+    values_.push_back(value);
+    handles_.push_back(handle);
+
+    return handle;
+  }
+
+  // inserts value with a handle issued by another slot map, replacing the value in its slot
+  void assign(uint16_t handle, const T& value) {
+    uint32_t s = get_slot(handle);
+
+    if (s >= slots_.size())
+      slots_.resize(s + 1);
+
+    if (slots_[s].index >= 0) {
+      values_[slots_[s].index] = value;
+      handles_[slots_[s].index] = handle;
+    } else {
+      slots_[s].index = values_.size();
+      values_.push_back(value);
+      handles_.push_back(handle);
+    }
+
+    slots_[s].handle = handle;
+  }
+
+  // returns false if handle is not in map
+  bool erase(uint16_t handle) {
+    int32_t index = get_index(handle);
+
+    if (index < 0)
+      return false;
+
+    // move last value into the gap
+    int32_t last = values_.size() - 1;
+    if (index != last) {
+      values_[index] = values_[last];
+      handles_[index] = handles_[last];
+      slots_[get_slot(handles_[index])].index = index;
+    }
+
+    values_.pop_back();
+    handles_.pop_back();
+
+    uint32_t s = get_slot(handle);
+    slots_[s].index = -1;
+    free_slots_.push_back(s);
+
+    return true;
+  }
+
+  // null if handle is not in map
+  T* find(uint16_t handle) {
+    int32_t index = get_index(handle);
+    return index < 0 ? nullptr : &values_[index];
+  }
+
+  const T* find(uint16_t handle) const {
+    int32_t index = get_index(handle);
+    return index < 0 ? nullptr : &values_[index];
+  }
+
+  bool contains(uint16_t handle) const {
+    return get_index(handle) >= 0;
+  }
+
+  // dense, in no particular order
+  std::vector<T>& get_values() {
+    return values_;
+  }
+
+  const std::vector<T>& get_values() const {
+    return values_;
+  }
+
+  size_t size() const {
+    return values_.size();
+  }
+
+  void clear() {
+    slots_.clear();
+    free_slots_.clear();
+    values_.clear();
+    handles_.clear();
+  }
+
+  // for arrays indexed by handle, every handle in map has a different slot below MAX_SIZE
+  static uint32_t get_slot(uint16_t handle) {
+    return handle & (MAX_SIZE - 1);
+  }
+
+private:
+  struct slot {
+    uint16_t handle; // of the value in slot or of the last one, generation 0 if never used
+    int32_t index; // in values_, -1 if free
+
+    slot()
+      : handle(0),
+        index(-1)
+    {
+    }
+  };
+
+  static uint32_t get_generation(uint16_t handle) {
+    return handle >> SLOT_BITS;
+  }
+
+  // skips 0, so that no handle is 0
+  static uint32_t next_generation(uint32_t generation) {
+    generation = (generation + 1) & ((1 << GENERATION_BITS) - 1);
+    return generation ? generation : 1;
+  }
+
+  static uint16_t make_handle(uint32_t slot, uint32_t generation) {
+    return static_cast<uint16_t>((generation << SLOT_BITS) | slot);
+  }
+
+  int32_t get_index(uint16_t handle) const {
+    uint32_t s = get_slot(handle);
+
+    if (!handle || s >= slots_.size() || slots_[s].handle != handle)
+      return -1;
+
+    return slots_[s].index;
+  }
+
+  std::vector<slot> slots_;
+  std::deque<uint32_t> free_slots_; // oldest first
+  std::vector<T> values_;
+  std::vector<uint16_t> handles_; // of values_
+};
+
+#endif // SLOT_MAP_HPP_
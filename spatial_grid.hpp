@@ -0,0 +1,91 @@
+#ifndef SPATIAL_GRID_HPP_
+#define SPATIAL_GRID_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "quantization.hpp"
+#include "world.hpp"
+
+// players within radius of a client's player are sent to it, and stay until farther than
+// radius + margin
+struct interest_area {
+  float radius; // meter
+  float margin; // meter
+
+  interest_area()
+    : radius(32),
+      margin(4)
+  {
+  }
+};
+
+///////////////////////////////////////////////////////////////////
+
+//
+// Player ids by position on the x/z plane, in square cells covering the whole quantized range.
+// A player is only moved between cells when it crosses a cell border.
+//
+
+class spatial_grid {
+public:
+  static const int CELL_SIZE = 8; // meter
+  static const int CELLS = 2 * quantization::POSITION_LIMIT / CELL_SIZE; // per axis
+
+  spatial_grid() {
+    player_cells_.fill(-1);
+  }
+
+  // adds player, or moves it to the cell of its new position
+  void update(uint16_t player_id, float x, float z) {
+    int cell = get_cell(x, z);
+    int& player_cell = player_cells_[world::get_slot(player_id)];
+
+    if (player_cell == cell)
+      return;
+
+    remove(player_id);
+    cells_[cell].push_back(player_id);
+    player_cell = cell;
+  }
+
+  void remove(uint16_t player_id) {
+    int& player_cell = player_cells_[world::get_slot(player_id)];
+
+    if (player_cell < 0)
+      return;
+
+    std::vector<uint16_t>& ids = cells_[player_cell];
+    ids.erase(std::find(ids.begin(), ids.end(), player_id));
+    player_cell = -1;
+  }
+
+  // appends ids of players in cells overlapping the square around x, z
+  void query(float x, float z, float radius, std::vector<uint16_t>& player_ids) const {
+    int x_begin = get_axis_cell(x - radius), x_end = get_axis_cell(x + radius);
+    int z_begin = get_axis_cell(z - radius), z_end = get_axis_cell(z + radius);
+
+    for (int cx = x_begin; cx <= x_end; cx++)
+      for (int cz = z_begin; cz <= z_end; cz++) {
+        const std::vector<uint16_t>& ids = cells_[cx * CELLS + cz];
+        player_ids.insert(player_ids.end(), ids.begin(), ids.end());
+      }
+  }
+
+private:
+  static int get_axis_cell(float position) {
+    int cell = std::floor((position + quantization::POSITION_LIMIT) / CELL_SIZE);
+    return std::min(std::max(cell, 0), CELLS - 1);
+  }
+
+  static int get_cell(float x, float z) {
+    return get_axis_cell(x) * CELLS + get_axis_cell(z);
+  }
+
+  std::array<std::vector<uint16_t>, CELLS * CELLS> cells_;
+  std::array<int, world::MAX_PLAYERS> player_cells_; // by slot of player id, -1 if not in grid
+};
+
+#endif // SPATIAL_GRID_HPP_
@@ -0,0 +1,88 @@
+#ifndef STREAM_READER_HPP_
+#define STREAM_READER_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <boost/asio.hpp>
+#include "slab_pool.hpp"
+
+namespace network {
+  //
+  // Receive buffer for a tcp stream. Each read fills as much free space as the socket has data
+  // for, then every complete message in the buffer is consumed in one pass. Only the bytes of an
+  // incomplete message are moved to the front. The buffer is a slab of fixed size, room for the
+  // largest message allowed plus one read, so a message over the limit must be rejected from
+  // its header (see read_messages). It is taken from the pool on the first read.
+  //
+
+  class stream_reader {
+  public:
+    static const size_t READ_SIZE = 16 * 1024; // bytes, least free space offered to a read
+
+    stream_reader(size_t max_frame_size)
+      : max_frame_size_(max_frame_size),
+        capacity_(max_frame_size + READ_SIZE),
+        begin_(0),
+        end_(0)
+    {
+    }
+
+    ~stream_reader() {
+      if (data_)
+        slab_pool::get_local().release(std::move(data_), capacity_);
+    }
+
+    stream_reader(const stream_reader&) = delete;
+    stream_reader& operator=(const stream_reader&) = delete;
+
+    // free space for the next read
+    boost::asio::mutable_buffers_1 prepare() {
+      if (!data_)
+        data_ = slab_pool::get_local().acquire(capacity_);
+
+      // move incomplete message to the front, it is smaller than max_frame_size
+      if (capacity_ - end_ < READ_SIZE) {
+        std::memmove(data_.get(), data_.get() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+      }
+
+      return boost::asio::buffer(data_.get() + end_, capacity_ - end_);
+    }
+
+    // adds bytes written by a read into the space from prepare
+    void commit(size_t size) {
+      end_ += size;
+    }
+
+    // received bytes not yet consumed
+    const uint8_t* data() const {
+      return data_.get() + begin_;
+    }
+
+    size_t size() const {
+      return end_ - begin_;
+    }
+
+    void consume(size_t size) {
+      begin_ += size;
+
+      if (begin_ == end_)
+        begin_ = end_ = 0;
+    }
+
+    // bytes, largest message accepted, header included
+    size_t get_max_frame_size() const {
+      return max_frame_size_;
+    }
+
+  private:
+    size_t max_frame_size_;
+    size_t capacity_;
+    slab data_;
+    size_t begin_; // first byte not consumed
+    size_t end_; // end of received bytes
+  };
+}
+
+#endif // STREAM_READER_HPP_
@@ -19,7 +19,7 @@ public:
 
   virtual void draw_clear() = 0;
 
-  virtual void draw_world(world& world, uint8_t perspective_player_id, bool draw_phantoms) = 0;
+  virtual void draw_world(world& world, uint16_t perspective_player_id, bool draw_phantoms) = 0;
 
   virtual void draw_update() = 0;
 };
@@ -123,7 +123,7 @@ public:
     SDL_RenderClear(renderer_);
   }
 
-  void draw_world(world& world, uint8_t perspective_player_id, bool draw_phantoms) {
+  void draw_world(world& world, uint16_t perspective_player_id, bool draw_phantoms) {
     // draw each player
     for (player& p : world.get_players()) {
       float a = p.get_horz_angel();
@@ -2,10 +2,8 @@
 #define UI_SDL_GL_HPP_
 
 #include <cstdint>
-#include <fstream>
 #include <list>
 #include <math.h>
-#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -13,11 +11,11 @@
 #include "glm/gtc/matrix_transform.hpp"
 #include <GL/glew.h>
 #include <SDL2/SDL.h>
-#include <boost/algorithm/string.hpp>
 #include <boost/optional.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "keyboard.hpp"
 #include "misc.hpp"
+#include "obj_loader.hpp"
 #include "world.hpp"
 
 class ui_sdl_gl : public ui {
@@ -97,7 +95,7 @@ public:
 
     std::vector<GLfloat> model_vertices, model_normals;
 
-    if(!get_geometry_data_from_file("mask.obj", model_vertices, model_normals))
+    if(!obj_loader::get_geometry_data_from_file("mask.obj", model_vertices, model_normals))
       throw std::runtime_error(std::string("error when loading model geometry"));
 
     geometry_mesh_size_ = model_vertices.size();
@@ -235,7 +233,7 @@ public:
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   }
 
-  virtual void draw_world(world& world, uint8_t perspective_player_id, bool draw_phantoms) {
+  virtual void draw_world(world& world, uint16_t perspective_player_id, bool draw_phantoms) {
     // get player to render scene for
     boost::optional<player&> cam_player = world.get_player(perspective_player_id);
 
@@ -306,60 +304,6 @@ private:
     return std::vector<int>();
   }
 
-  bool get_geometry_data_from_file(const char* file, std::vector<GLfloat>& vertices,
-      std::vector<GLfloat>& normals) {
-    std::ifstream file_stream(file);
-
-    if (!file_stream.is_open()) {
-      INFO("error, could not open file: " << file);
-      return false;
-    }
-
-    std::vector<std::string> vertex_lines, normal_lines;
-
-    while (file_stream.good()) {
-      std::string line;
-      getline(file_stream, line);
-
-      // read all strings holding vertices and normals
-      if (line[0] == 'v') {
-        if (line[1] == 'n')
-          normal_lines.push_back(line);
-        else
-          vertex_lines.push_back(line);
-
-        continue;
-      }
-
-      // read strings holding faces and put there values into argument vectors
-      if (line[0] == 'f') {
-        std::vector<std::string> edges;
-        boost::split(edges, line, boost::is_any_of(" ")); // split "f 1//1 2//2 4//3"
-
-        for (size_t i = 1; i < edges.size(); i++) {
-          std::vector<std::string> indices;
-          boost::split(indices, edges[i], boost::is_any_of("/")); // split "1//1"
-
-          GLfloat temp;
-
-          std::istringstream vertex_stream(vertex_lines[stoi(indices[0]) - 1]);
-          vertex_stream.ignore(32, ' '); // skip "v"
-          while (vertex_stream >> temp)
-            vertices.push_back(temp);
-
-          std::istringstream normal_stream(normal_lines[stoi(indices[2]) - 1]);
-          normal_stream.ignore(32, ' '); // skip "vn"
-          while (normal_stream >> temp)
-            normals.push_back(temp);
-        }
-      }
-    }
-
-    file_stream.close();
-
-    return true;
-  }
-
   GLuint create_shader_program(const char* vertex_file_path, const char* fragment_file_path) {
     std::string vertex_shader_code = misc::get_file_content(vertex_file_path);
     if (vertex_shader_code.empty()) {
@@ -0,0 +1,540 @@
+#ifndef URING_SOCKET_HPP_
+#define URING_SOCKET_HPP_
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include "datagram_socket.hpp"
+#include "frame.hpp"
+#include "misc.hpp"
+
+namespace network {
+  //
+  // Udp socket of the server on io_uring, without liburing. Sends are copied into preallocated
+  // slots and queued as submissions, flush hands all queued sends to the kernel in one system call,
+  // so a snapshot round to every client costs one call instead of one per client. Receiving is a
+  // single multishot recvmsg into a ring of buffers registered with the kernel, completions are
+  // reaped on a strand when an eventfd signals them. Without io_uring in the kernel the plain
+  // socket is used.
+  //
+
+  class uring_socket {
+  public:
+    static const unsigned int QUEUE_SIZE = 1024; // submission entries, also the number of slots
+    static const size_t SLOT_SIZE = 2048; // bytes, larger datagrams are sent right away
+    static const unsigned int RECEIVE_BUFFER_COUNT = 256; // power of 2
+    static const size_t RECEIVE_BUFFER_SIZE = 4096; // bytes, larger datagrams are dropped
+
+    uring_socket(boost::asio::io_service& io_service,
+        const boost::asio::ip::udp::endpoint& endpoint)
+      : socket_(io_service, endpoint),
+        event_(io_service),
+        ring_fd_(-1),
+        sq_ring_(MAP_FAILED),
+        cq_ring_(MAP_FAILED),
+        sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+        buffer_ring_(static_cast<io_uring_buf*>(MAP_FAILED)),
+        sq_tail_(0),
+        unsubmitted_(0),
+        queued_sends_(0),
+        buffer_tail_(0),
+        strand_(nullptr),
+        cancelled_(false)
+    {
+      if (!setup()) {
+        INFO("io_uring not available, using plain udp socket");
+        teardown();
+      }
+    }
+
+    ~uring_socket() {
+      if (ring_fd_ >= 0)
+        cancel_receive();
+
+      teardown();
+    }
+
+    uring_socket(const uring_socket&) = delete;
+    uring_socket& operator=(const uring_socket&) = delete;
+
+    // queues a datagram until the next flush, sends it at once if it does not fit a slot
+    template <typename ConstBufferSequence>
+    void send_to(const ConstBufferSequence& buffers,
+        const boost::asio::ip::udp::endpoint& endpoint, int flags,
+        boost::system::error_code& error) {
+      size_t size = boost::asio::buffer_size(buffers);
+      std::unique_lock<std::mutex> lock(mutex_);
+      io_uring_sqe* sqe = nullptr;
+
+      if (ring_fd_ >= 0 && size <= SLOT_SIZE && free_slots_.size())
+        sqe = get_sqe();
+
+      if (!sqe) {
+        lock.unlock();
+        socket_.send_to(buffers, endpoint, flags, error);
+        counters_.count_send(1);
+        return;
+      }
+
+      uint32_t s = free_slots_.back();
+      free_slots_.pop_back();
+
+      send_slot& slot = slots_[s];
+      boost::asio::buffer_copy(boost::asio::buffer(slot.data, SLOT_SIZE), buffers);
+      std::memcpy(&slot.address, endpoint.data(), endpoint.size());
+      slot.iov.iov_base = slot.data;
+      slot.iov.iov_len = size;
+      std::memset(&slot.message, 0, sizeof(slot.message));
+      slot.message.msg_name = &slot.address;
+      slot.message.msg_namelen = endpoint.size();
+      slot.message.msg_iov = &slot.iov;
+      slot.message.msg_iovlen = 1;
+
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = socket_.native_handle();
+      sqe->addr = reinterpret_cast<uint64_t>(&slot.message);
+      sqe->len = 1;
+      sqe->msg_flags = flags;
+      sqe->user_data = s;
+      queued_sends_++;
+
+      error = boost::system::error_code();
+    }
+
+    // queues a datagram of header followed by the messages of data, copied into a slot
+    void send_to(const message_buffer& header, const frame& data,
+        const boost::asio::ip::udp::endpoint& endpoint) {
+      std::vector<boost::asio::const_buffer> buffers;
+      buffers.reserve(1 + data.get_messages().size());
+      buffers.push_back(boost::asio::buffer(header->data));
+      data.get_buffers(buffers);
+
+      boost::system::error_code error;
+      send_to(buffers, endpoint, 0, error);
+
+      if (error)
+        DEBUG("send_to(): " << error.message());
+    }
+
+    // submits every queued datagram in one system call
+    void flush() {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (ring_fd_ >= 0)
+        submit();
+    }
+
+    // handler(const uint8_t* data, size_t size, const udp::endpoint& sender) is called on strand
+    // for every datagram, data is only valid during the call
+    template <typename Handler>
+    void start_receive(boost::asio::io_service::strand& strand, Handler handler) {
+      if (ring_fd_ < 0) {
+        start_socket_receive(strand, handler);
+        return;
+      }
+
+      strand_ = &strand;
+      receive_handler_ = handler;
+      arm_receive();
+      wait_for_completions();
+    }
+
+    // stops receiving, also if the wait has already completed, on the receive strand or with
+    // no thread running it. the receive in the ring is cancelled when the socket is destroyed.
+    void cancel() {
+      boost::system::error_code error;
+      cancelled_ = true;
+      socket_.cancel(error);
+      event_.cancel(error);
+    }
+
+    datagram_stats get_stats() const {
+      return counters_.get();
+    }
+
+  private:
+    static const uint64_t RECEIVE = UINT64_MAX; // user data of the receive, sends use their slot
+    static const uint64_t CANCEL = UINT64_MAX - 1;
+    static const uint16_t BUFFER_GROUP = 0;
+
+    struct send_slot {
+      uint8_t data[SLOT_SIZE];
+      sockaddr_storage address;
+      iovec iov;
+      msghdr message;
+    };
+
+    static int io_uring_setup(unsigned int entries, io_uring_params* params) {
+      return syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags) {
+      return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int count) {
+      return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+
+    bool setup() {
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+
+      ring_fd_ = io_uring_setup(QUEUE_SIZE, &params);
+      if (ring_fd_ < 0)
+        return false;
+
+      // rings and submission entries are shared with the kernel by mmap
+      sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+      cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+      sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+          ring_fd_, IORING_OFF_SQ_RING);
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+          ring_fd_, IORING_OFF_CQ_RING);
+      sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+
+      if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+        return false;
+
+      uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+      uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+      sq_head_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+      sq_tail_ptr_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+      sq_mask_ = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+      sq_entries_ = params.sq_entries;
+      sq_array_ = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+      cq_head_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+      cq_tail_ = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+      cq_mask_ = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+      cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+      sq_tail_ = *sq_tail_ptr_;
+
+      // receive buffers, the kernel picks a free one for each datagram
+      buffer_ring_ = static_cast<io_uring_buf*>(mmap(nullptr,
+          RECEIVE_BUFFER_COUNT * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (buffer_ring_ == MAP_FAILED)
+        return false;
+
+      io_uring_buf_reg reg;
+      std::memset(&reg, 0, sizeof(reg));
+      reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+      reg.ring_entries = RECEIVE_BUFFER_COUNT;
+      reg.bgid = BUFFER_GROUP;
+
+      if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+      receive_buffers_.resize(RECEIVE_BUFFER_COUNT * RECEIVE_BUFFER_SIZE);
+      for (uint16_t b = 0; b < RECEIVE_BUFFER_COUNT; b++)
+        recycle_buffer(b);
+
+      // completions are signaled on an eventfd the io service waits for
+      int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (event_fd < 0)
+        return false;
+
+      event_.assign(event_fd);
+      if (io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+        return false;
+
+      std::memset(&receive_message_, 0, sizeof(receive_message_));
+      receive_message_.msg_namelen = sizeof(sockaddr_storage);
+
+      slots_.resize(QUEUE_SIZE);
+      for (uint32_t s = QUEUE_SIZE; s-- > 0;)
+        free_slots_.push_back(s);
+
+      return true;
+    }
+
+    void teardown() {
+      if (ring_fd_ >= 0)
+        close(ring_fd_);
+      if (sq_ring_ != MAP_FAILED)
+        munmap(sq_ring_, sq_ring_size_);
+      if (cq_ring_ != MAP_FAILED)
+        munmap(cq_ring_, cq_ring_size_);
+      if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqes_size_);
+      if (buffer_ring_ != MAP_FAILED)
+        munmap(buffer_ring_, RECEIVE_BUFFER_COUNT * sizeof(io_uring_buf));
+
+      ring_fd_ = -1;
+      sq_ring_ = cq_ring_ = MAP_FAILED;
+      sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+      buffer_ring_ = static_cast<io_uring_buf*>(MAP_FAILED);
+      boost::system::error_code error;
+      event_.close(error);
+    }
+
+    // next free submission entry, cleared, or null if the queue stays full. mutex_ is held.
+    io_uring_sqe* get_sqe() {
+      if (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+        submit();
+
+        if (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+          return nullptr;
+      }
+
+      unsigned int index = sq_tail_ & sq_mask_;
+      sq_array_[index] = index;
+      sq_tail_++;
+      unsubmitted_++;
+
+      io_uring_sqe* sqe = &sqes_[index];
+      std::memset(sqe, 0, sizeof(*sqe));
+      return sqe;
+    }
+
+    // mutex_ is held
+    void submit() {
+      if (!unsubmitted_)
+        return;
+
+      __atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+      int submitted = io_uring_enter(ring_fd_, unsubmitted_, 0, 0);
+
+      if (submitted < 0) {
+        counters_.count_send(0);
+        DEBUG("io_uring_enter(): " << std::strerror(errno));
+      } else {
+        unsubmitted_ -= submitted;
+
+        // a receive or cancel may be among the submissions, all queued sends are
+        if (!unsubmitted_) {
+          counters_.count_send(queued_sends_);
+          queued_sends_ = 0;
+        }
+      }
+    }
+
+    void arm_receive() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      io_uring_sqe* sqe = get_sqe();
+
+      if (!sqe) {
+        DEBUG("submission queue full, receive not armed");
+        return;
+      }
+
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->fd = socket_.native_handle();
+      sqe->addr = reinterpret_cast<uint64_t>(&receive_message_);
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUFFER_GROUP;
+      sqe->user_data = RECEIVE;
+      submit();
+    }
+
+    void wait_for_completions() {
+      event_.async_read_some(boost::asio::buffer(&event_count_, sizeof(event_count_)),
+          strand_->wrap([this](const boost::system::error_code& error, size_t size) {
+            if (cancelled_ || error == boost::asio::error::operation_aborted)
+              return;
+
+            reap_completions();
+            wait_for_completions();
+          }));
+    }
+
+    void reap_completions() {
+      unsigned int head = *cq_head_;
+      unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      bool rearm = false;
+      uint64_t datagrams = 0;
+
+      for (; head != tail; head++) {
+        io_uring_cqe cqe = cqes_[head & cq_mask_];
+
+        if (cqe.user_data == RECEIVE) {
+          if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+            handle_datagram(cqe.flags >> IORING_CQE_BUFFER_SHIFT, cqe.res);
+            datagrams++;
+          }
+          else if (cqe.res < 0 && cqe.res != -ENOBUFS)
+            DEBUG("recvmsg(): " << std::strerror(-cqe.res));
+
+          // multishot ends on errors, also when all buffers are taken
+          if (!(cqe.flags & IORING_CQE_F_MORE))
+            rearm = true;
+        } else if (cqe.user_data != CANCEL) {
+          if (cqe.res < 0)
+            DEBUG("sendmsg(): " << std::strerror(-cqe.res));
+
+          std::lock_guard<std::mutex> lock(mutex_);
+          free_slots_.push_back(cqe.user_data);
+        }
+      }
+
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+      // the read of the eventfd is the system call of the receive path
+      counters_.count_receive(datagrams);
+
+      if (rearm)
+        arm_receive();
+    }
+
+    void handle_datagram(uint16_t buffer_id, int size) {
+      const uint8_t* buffer = receive_buffers_.data() + buffer_id * RECEIVE_BUFFER_SIZE;
+      io_uring_recvmsg_out out;
+      std::memcpy(&out, buffer, sizeof(out));
+
+      size_t name_pos = sizeof(io_uring_recvmsg_out);
+      size_t payload_pos = name_pos + receive_message_.msg_namelen
+          + receive_message_.msg_controllen;
+
+      if (!(out.flags & MSG_TRUNC) && out.namelen <= receive_message_.msg_namelen
+          && payload_pos + out.payloadlen <= static_cast<size_t>(size)) {
+        boost::asio::ip::udp::endpoint sender;
+        std::memcpy(sender.data(), buffer + name_pos, out.namelen);
+        sender.resize(out.namelen);
+
+        receive_handler_(buffer + payload_pos, out.payloadlen, sender);
+      } else {
+        DEBUG("datagram dropped, larger than receive buffer");
+      }
+
+      recycle_buffer(buffer_id);
+    }
+
+    // gives a receive buffer back to the kernel
+    void recycle_buffer(uint16_t buffer_id) {
+      io_uring_buf& b = buffer_ring_[buffer_tail_ & (RECEIVE_BUFFER_COUNT - 1)];
+      b.addr = reinterpret_cast<uint64_t>(receive_buffers_.data()
+          + buffer_id * RECEIVE_BUFFER_SIZE);
+      b.len = RECEIVE_BUFFER_SIZE;
+      b.bid = buffer_id;
+
+      buffer_tail_++;
+      // the ring tail is the reserved field of the first entry, io_uring_buf_ring has another
+      // layout in c++ than in c
+      __atomic_store_n(&buffer_ring_[0].resv, buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+    // stops the multishot receive before its buffers are freed, io handlers no longer run
+    void cancel_receive() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        io_uring_sqe* sqe = get_sqe();
+
+        if (!sqe)
+          return;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = RECEIVE;
+        sqe->user_data = CANCEL;
+        submit();
+      }
+
+      // the receive ends with a completion without more to follow, waited for a while at most
+      __kernel_timespec timeout = { 0, 10 * 1000000 };
+      io_uring_getevents_arg arg;
+      std::memset(&arg, 0, sizeof(arg));
+      arg.ts = reinterpret_cast<uint64_t>(&timeout);
+      unsigned int head = *cq_head_;
+
+      for (int i = 0; i < 10; i++) {
+        unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+          const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+
+          if (cqe.user_data == RECEIVE && !(cqe.flags & IORING_CQE_F_MORE))
+            return;
+        }
+
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+      }
+    }
+
+    template <typename Handler>
+    void start_socket_receive(boost::asio::io_service::strand& strand, Handler handler) {
+      socket_.async_receive_from(boost::asio::buffer(socket_buffer_), sender_endpoint_,
+          strand.wrap([this, &strand, handler](const boost::system::error_code& error,
+              size_t size) {
+            if (cancelled_)
+              return;
+
+            if (error) {
+              DEBUG("async_receive_from(): " << error.message());
+
+              if (error == boost::asio::error::operation_aborted)
+                return;
+            } else {
+              counters_.count_receive(1);
+              handler(socket_buffer_.data(), size, sender_endpoint_);
+            }
+
+            start_socket_receive(strand, handler);
+          }));
+    }
+
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::posix::stream_descriptor event_;
+    uint64_t event_count_;
+
+    // rings shared with the kernel
+    int ring_fd_;
+    void* sq_ring_;
+    void* cq_ring_;
+    io_uring_sqe* sqes_;
+    io_uring_buf* buffer_ring_; // tail overlays resv of entry 0
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+    unsigned int* sq_head_;
+    unsigned int* sq_tail_ptr_;
+    unsigned int sq_mask_;
+    unsigned int sq_entries_;
+    unsigned int* sq_array_;
+    unsigned int* cq_head_;
+    unsigned int* cq_tail_;
+    unsigned int cq_mask_;
+    io_uring_cqe* cqes_;
+
+    datagram_counters counters_;
+
+    // sending, submissions and slots are guarded by mutex_ since any strand may send
+    std::mutex mutex_;
+    unsigned int sq_tail_; // entries up to here are filled
+    unsigned int unsubmitted_;
+    uint64_t queued_sends_; // not yet submitted
+    std::vector<send_slot> slots_;
+    std::vector<uint32_t> free_slots_;
+
+    // receiving, only used on strand_
+    uint16_t buffer_tail_;
+    std::vector<uint8_t> receive_buffers_;
+    msghdr receive_message_;
+    boost::asio::io_service::strand* strand_;
+    std::function<void(const uint8_t*, size_t, const boost::asio::ip::udp::endpoint&)>
+        receive_handler_;
+    bool cancelled_; // receiving stopped
+
+    // plain socket without io_uring
+    boost::asio::ip::udp::endpoint sender_endpoint_;
+    std::array<uint8_t, 65536> socket_buffer_;
+  };
+}
+
+#endif // URING_SOCKET_HPP_
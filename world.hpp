@@ -8,7 +8,9 @@
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/vector.hpp>
 #include "command.hpp"
+#include "movement.hpp"
 #include "player.hpp"
+#include "slot_map.hpp"
 
 class world {
 public:
@@ -16,74 +18,139 @@ public:
 
   static const int WIDTH = 5; // meter
   static const int HEIGTH = 5; // meter
+  static const int MAX_PLAYERS = slot_map<player>::MAX_SIZE; // player ids are slot map handles
 
   bool add_player(player& player) {
-    uint8_t player_id = generate_player_id();
+    uint16_t player_id = players_.insert(player);
 
     if (!player_id)
       return false;
 
     player.set_id(player_id);
     assign_random_position(player);
-    players_.push_back(player);
+    *players_.find(player_id) = player;
 
     return true;
   }
 
-  void remove_player(uint8_t player_id) {
-    auto i = players_.begin();
-
-    while (i != players_.end()) {
-      if (i->get_id() == player_id) {
-        players_.erase(i);
-        break;
-      }
-      i++;
-    }
+  void remove_player(uint16_t player_id) {
+    players_.erase(player_id);
   }
 
-  boost::optional<player&> get_player(uint8_t player_id) {
+  boost::optional<player&> get_player(uint16_t player_id) {
     boost::optional<player&> opt_player;
+    player* p = players_.find(player_id);
 
-    for (auto& p : players_) {
-      if (p.get_id() == player_id) {
-        opt_player = p;
-        break;
-      }
-    }
+    if (p)
+      opt_player = *p;
 
     return opt_player;
   }
 
+  boost::optional<const player&> get_player(uint16_t player_id) const {
+    boost::optional<const player&> opt_player;
+    const player* p = players_.find(player_id);
+
+    if (p)
+      opt_player = *p;
+
+    return opt_player;
+  }
+
+  // adds player with its id and position kept, or overwrites the player with the same id
+  void set_player(const player& new_player) {
+    players_.assign(new_player.get_id(), new_player);
+  }
+
+  // below MAX_PLAYERS and different for every player in world, for arrays by player
+  static uint32_t get_slot(uint16_t player_id) {
+    return slot_map<player>::get_slot(player_id);
+  }
+
+  // dense, in no particular order
   std::vector<player>& get_players() {
-    return players_;
+    return players_.get_values();
+  }
+
+  const std::vector<player>& get_players() const {
+    return players_.get_values();
   }
 
-  bool player_exists(uint8_t player_id) const {
-    return !player_id_is_free(player_id);
+  bool player_exists(uint16_t player_id) const {
+    return players_.contains(player_id);
   }
 
-  void run_command(const command& cmd, uint8_t player_id) {
+  void run_command(const command& cmd, uint16_t player_id) {
     boost::optional<player&> opt_p = get_player(player_id);
 
     if (opt_p)
       opt_p.get().run_command(cmd);
   }
 
+  // runs commands[i] for player_ids[i], at most one command per player, in one batch
+  void run_commands(const std::vector<uint16_t>& player_ids,
+      const std::vector<command>& commands) {
+    // a batch of one costs more to gather than it saves, the result is the same
+    if (player_ids.size() == 1) {
+      run_command(commands.front(), player_ids.front());
+      return;
+    }
+
+    // gather into parallel arrays, which keep their capacity from round to round. they are
+    // filled by index, players not found are skipped.
+    batch_.resize(player_ids.size());
+    batch_players_.resize(player_ids.size());
+    batch_command_ids_.resize(player_ids.size());
+    size_t n = 0;
+
+    for (size_t i = 0; i < player_ids.size(); i++) {
+      player* p = players_.find(player_ids[i]);
+
+      if (!p)
+        continue;
+
+      batch_players_[n] = p;
+      batch_command_ids_[n] = commands[i].id;
+      batch_.set(n, p->get_x(), p->get_y(), p->get_z(), p->get_horz_angel(),
+          p->get_vert_angel(), commands[i]);
+      n++;
+    }
+
+    batch_.resize(n);
+    batch_players_.resize(n);
+
+    batch_.run();
+
+    // scatter back
+    for (size_t i = 0; i < batch_players_.size(); i++) {
+      player* p = batch_players_[i];
+      p->set_x(batch_.x[i]);
+      p->set_y(batch_.y[i]);
+      p->set_z(batch_.z[i]);
+      p->set_horz_angel(batch_.horz_angel[i]);
+      p->set_vert_angel(batch_.vert_angel[i]);
+      p->set_last_command_id(batch_command_ids_[i]);
+    }
+
+    // no pointers into players are left behind for copies of the world
+    batch_players_.clear();
+  }
+
 private:
   friend class boost::serialization::access;
 
+  // players in the same format as a plain vector, ids are restored from the players
   template<class Archive>
   void serialize(Archive& ar, const unsigned int version) {
-    ar & players_;
-  }
+    std::vector<player> players = players_.get_values();
+    ar & players;
 
-  bool player_id_is_free(uint8_t id) const {
-    for (const player& p : players_)
-      if (p.get_id() == id)
-        return false;
+    if (Archive::is_loading::value) {
+      players_.clear();
 
-    return true;
+      for (const player& p : players)
+        players_.assign(p.get_id(), p);
+    }
   }
 
   void assign_random_position(player& player) {
@@ -97,19 +164,12 @@ private:
     player.set_z(dis2(gen));
   }
 
-  uint8_t generate_player_id() const {
-    uint8_t new_id = 1;
-
-    while (new_id) {
-      if (player_id_is_free(new_id))
-        return new_id;
-      new_id++;
-    }
-
-    return 0;
-  }
+  slot_map<player> players_;
 
-  std::vector<player> players_;
+  // scratch of run_commands, not part of the world state
+  movement::batch batch_;
+  std::vector<player*> batch_players_;
+  std::vector<int> batch_command_ids_;
 };
 
 #endif // WORLD_HPP_
@@ -0,0 +1,157 @@
+#ifndef WORLD_HISTORY_HPP_
+#define WORLD_HISTORY_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "player.hpp"
+#include "quantization.hpp"
+#include "world.hpp"
+
+//
+// Player states of the last ticks, for looking at the world as a client saw it when it acted
+// (lag compensation): the time of the current tick minus half its round trip and its
+// interpolation time. One entry per tick in a ring of window_ms of ticks. Entries grow with the
+// players of the instance, up to max_players, and keep their memory, so ticks do not allocate
+// once the player count is steady. A tick is found from a time by arithmetic, a player in a tick
+// by the slot of its id.
+//
+
+class world_history {
+public:
+  struct player_state {
+    uint16_t id;
+    float x, y, z;
+    float horz_angel, vert_angel;
+  };
+
+  world_history(int tick_rate, int window_ms, size_t max_players)
+    : tick_rate_(tick_rate),
+      max_players_(max_players),
+      entries_(window_ms * tick_rate / 1000 + 2)
+  {
+    for (auto& e : entries_)
+      e.tick = NO_TICK;
+  }
+
+  // stores the players of world as the state after tick, players beyond max_players are left
+  // out
+  void record(uint64_t tick, const world& w) {
+    entry& e = entries_[tick % entries_.size()];
+
+    for (const player_state& s : e.players)
+      e.index[world::get_slot(s.id)] = -1;
+
+    e.players.clear();
+    e.tick = tick;
+
+    for (const player& p : w.get_players()) {
+      if (e.players.size() == max_players_)
+        break;
+
+      size_t slot = world::get_slot(p.get_id());
+
+      // the slot map keeps few slots free, so the index follows the most players seen
+      if (slot >= e.index.size())
+        e.index.resize(slot + 1, -1);
+
+      e.index[slot] = e.players.size();
+      e.players.push_back({ p.get_id(), p.get_x(), p.get_y(), p.get_z(), p.get_horz_angel(),
+          p.get_vert_angel() });
+    }
+  }
+
+  // state of a player at a time in ms since tick 0, interpolated between the ticks around it.
+  // false if the time is not in the window or the player is not in both ticks.
+  bool get_player(double time_ms, uint16_t player_id, player_state& state) const {
+    const entry* from;
+    const entry* to;
+    float fraction;
+
+    if (!find_ticks(time_ms, from, to, fraction))
+      return false;
+
+    const player_state* a = find_player(*from, player_id);
+    const player_state* b = find_player(*to, player_id);
+
+    if (!a || !b)
+      return false;
+
+    state = interpolate(*a, *b, fraction);
+    return true;
+  }
+
+  // world with every player at a time, see get_player. false if the time is not in the window.
+  bool get_world(double time_ms, world& w) const {
+    const entry* from;
+    const entry* to;
+    float fraction;
+
+    if (!find_ticks(time_ms, from, to, fraction))
+      return false;
+
+    for (const player_state& b : to->players) {
+      const player_state* a = find_player(*from, b.id);
+      player_state s = interpolate(a ? *a : b, b, fraction);
+
+      player p;
+      p.set_id(s.id);
+      p.set_x(s.x);
+      p.set_y(s.y);
+      p.set_z(s.z);
+      p.set_horz_angel(s.horz_angel);
+      p.set_vert_angel(s.vert_angel);
+      w.set_player(p);
+    }
+
+    return true;
+  }
+
+private:
+  static const uint64_t NO_TICK = UINT64_MAX;
+
+  struct entry {
+    uint64_t tick;
+    std::vector<player_state> players;
+    std::vector<int32_t> index; // into players by slot of player id, -1 if none or beyond
+  };
+
+  bool find_ticks(double time_ms, const entry*& from, const entry*& to, float& fraction) const {
+    if (time_ms < 0)
+      return false;
+
+    double tick = time_ms * tick_rate_ / 1000;
+    uint64_t first = static_cast<uint64_t>(tick);
+
+    from = &entries_[first % entries_.size()];
+    to = &entries_[(first + 1) % entries_.size()];
+    fraction = tick - first;
+
+    // entries are overwritten by newer ticks, or the time is ahead of the last tick
+    return from->tick == first && to->tick == first + 1;
+  }
+
+  static const player_state* find_player(const entry& e, uint16_t player_id) {
+    size_t slot = world::get_slot(player_id);
+    int32_t i = slot < e.index.size() ? e.index[slot] : -1;
+    return i >= 0 && e.players[i].id == player_id ? &e.players[i] : nullptr;
+  }
+
+  static player_state interpolate(const player_state& a, const player_state& b, float fraction) {
+    player_state s = b;
+    s.x = a.x + (b.x - a.x) * fraction;
+    s.y = a.y + (b.y - a.y) * fraction;
+    s.z = a.z + (b.z - a.z) * fraction;
+    s.horz_angel = a.horz_angel
+        + quantization::angel_difference(a.horz_angel, b.horz_angel) * fraction;
+    s.vert_angel = a.vert_angel
+        + quantization::angel_difference(a.vert_angel, b.vert_angel) * fraction;
+    return s;
+  }
+
+  int tick_rate_;
+  size_t max_players_;
+  std::vector<entry> entries_; // by tick modulo size
+};
+
+#endif // WORLD_HISTORY_HPP_
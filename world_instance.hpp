@@ -0,0 +1,681 @@
+#ifndef WORLD_INSTANCE_HPP_
+#define WORLD_INSTANCE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include "misc.hpp"
+#include "network.hpp"
+#include "server_config.hpp"
+#include "spatial_grid.hpp"
+#include "world.hpp"
+#include "world_history.hpp"
+
+//
+// One world hosted by the server with its own players, tick and snapshots. Everything about the
+// game (world, grid, the list of connections and the command queues) is only used on the
+// simulation strand of the instance, which runs on the io service of one worker thread shared
+// with other instances. Snapshot encoding runs on the strands of the connections.
+//
+
+class world_instance : public std::enable_shared_from_this<world_instance> {
+public:
+  static const int CLIENT_UPDATE_INTERVAL_MS = 50;
+
+  static const int NEW_PLAYER_PRIORITY = 4; // as a change of 4 meter
+  static const size_t MAX_QUEUED_COMMANDS = 2 * network::command_batch::MAX_COMMANDS;
+  static const int TICK_COST_REPORT_INTERVAL_MS = 5000;
+
+  // closes a connection of the server, may be called from any strand
+  using close_handler = std::function<void(network::connection_ptr)>;
+
+  world_instance(uint32_t room, boost::asio::io_service& io_service,
+      network::datagram_socket& udp_socket, const server_config& config,
+      close_handler close)
+    : room_(room),
+      config_(config),
+      close_(close),
+      game_time_ms_(0),
+      snapshot_sequence_(0),
+      tick_count_(0),
+      history_(config.tick_rate, config.history_ms, config.history_players),
+      tick_cost_ticks_(0),
+      tick_cost_total_us_(0),
+      tick_cost_max_us_(0),
+      tick_cost_report_ms_(misc::get_time_ms()),
+      tick_cost_us_(0),
+      stopped_(false),
+      simulation_(io_service),
+      timer_(io_service),
+      tick_timer_(io_service),
+      udp_socket_(udp_socket)
+  {
+  }
+
+  // timers hold the instance until stopped
+  void start() {
+    auto self = shared_from_this();
+    simulation_.post([this, self]() {
+      start_client_updater();
+      tick_timer_.expires_from_now(boost::posix_time::microseconds(0));
+      start_tick();
+    });
+  }
+
+  void stop() {
+    auto self = shared_from_this();
+    simulation_.post([this, self]() {
+      stopped_ = true;
+      timer_.cancel();
+      tick_timer_.cancel();
+    });
+  }
+
+  // adds the player of a connection, the udp token of the connection is already set
+  void post_join(network::connection_ptr connection, const network::join_request& m) {
+    auto self = shared_from_this();
+    simulation_.post([this, self, connection, m]() {
+      join(connection, m);
+    });
+  }
+
+  void post_commands(network::connection_ptr connection, network::command_batch m) {
+    auto self = shared_from_this();
+    simulation_.post([this, self, connection, m]() mutable {
+      process_message(connection, m);
+    });
+  }
+
+  void post_leave(network::connection_ptr connection) {
+    auto self = shared_from_this();
+    simulation_.post([this, self, connection]() {
+      leave(connection);
+    });
+  }
+
+  uint32_t get_room() const {
+    return room_;
+  }
+
+  // average simulation time of a tick over the last report interval, for placing instances
+  uint64_t get_tick_cost_us() const {
+    return tick_cost_us_;
+  }
+
+  // game time a client saw when acting at now_ms. it shows snapshots interpolation_time_ms
+  // after receiving them, half a round trip after they were sent.
+  static double get_rewind_time_ms(uint64_t now_ms, uint32_t rtt_ms, int interpolation_time_ms) {
+    return static_cast<double>(now_ms) - rtt_ms / 2.0 - interpolation_time_ms;
+  }
+
+  // world as the client of a connection saw it when acting at the last tick, for validating
+  // its actions (lag compensation). only on the simulation strand. false if that is further
+  // back than the history.
+  bool rewind(const network::connection& connection, world& view) const {
+    return history_.get_world(get_rewind_time_ms(game_time_ms_, connection.rtt_ms,
+        connection.interpolation_time_ms), view);
+  }
+
+private:
+  // delta messages of the whole world by baseline, built once per snapshot and shared by the
+  // clients that see every player and acknowledged the same baseline
+  class delta_cache {
+  public:
+    network::message_buffer find(const network::world_snapshot* baseline) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto i = messages_.find(baseline);
+      return i != messages_.end() ? i->second : network::message_buffer();
+    }
+
+    void insert(const network::world_snapshot* baseline, const network::message_buffer& m) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      messages_[baseline] = m;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::map<const network::world_snapshot*, network::message_buffer> messages_;
+  };
+
+  void join(network::connection_ptr connection, const network::join_request& m) {
+    player p;
+    p.set_color_AABBGGRR(m.player_color_AABBGGRR);
+
+    if (world_.add_player(p)) {
+      grid_.update(p.get_id(), p.get_x(), p.get_z());
+      connection->player_id = p.get_id();
+      connection->player_priorities.assign(world::MAX_PLAYERS, 0);
+      connections_.push_back(connection);
+
+      // confirm join
+      network::server_accept accept;
+      accept.player_id = p.get_id();
+      accept.udp_token = connection->udp_token;
+      network::send_object(connection, accept, udp_socket_);
+
+      INFO("player joined, id: " << std::to_string(p.get_id()) << ", room: " << room_);
+    } else {
+      // reject join
+      network::server_deny deny;
+      deny.reason = "player limit reached";
+      network::send_object(connection, deny, udp_socket_);
+
+      INFO("player rejected, reason: " << deny.reason);
+    }
+  }
+
+  void leave(network::connection_ptr connection) {
+    auto i = std::find(connections_.begin(), connections_.end(), connection);
+    if (i == connections_.end())
+      return;
+
+    connections_.erase(i);
+    world_.remove_player(connection->player_id);
+    grid_.remove(connection->player_id);
+  }
+
+  void process_message(network::connection_ptr connection, network::command_batch& m) {
+    std::sort(m.commands.begin(), m.commands.end(),
+        [](const command& a, const command& b) { return a.id < b.id; });
+
+    for (auto& c : m.commands)
+      process_command(connection, c);
+  }
+
+  // queues command to be simulated by a later tick
+  void process_command(network::connection_ptr connection, const command& c) {
+    if (!movement::is_valid(c)) {
+      DEBUG("invalid command, player id: " << std::to_string(connection->player_id));
+      return;
+    }
+
+    // skip commands already applied, batches resend them and udp may reorder them
+    boost::optional<player&> p = world_.get_player(connection->player_id);
+    if (p && c.id <= p.get().get_last_command_id())
+      return;
+
+    std::deque<command>& queue = connection->queued_commands;
+    auto i = std::lower_bound(queue.begin(), queue.end(), c,
+        [](const command& a, const command& b) { return a.id < b.id; });
+
+    if (i != queue.end() && i->id == c.id)
+      return;
+
+    if (queue.size() >= MAX_QUEUED_COMMANDS) {
+      DEBUG("command queue full, player id: " << std::to_string(connection->player_id));
+      return;
+    }
+
+    if (queue.empty())
+      connection->buffering_since_ms = misc::get_time_ms();
+
+    queue.insert(i, c);
+  }
+
+  //
+  // Runs queued commands of every player. Each tick a player may use up to one tick of
+  // simulation time, measured by the frame time of its commands, so commands arriving in a burst
+  // are spread over several ticks. When the queue runs dry it first refills for
+  // jitter_buffer_ms before commands run again.
+  //
+  void run_tick() {
+    uint64_t start_us = misc::get_time_us();
+    int64_t tick_us = 1000000 / config_.tick_rate;
+    int64_t max_allowance_us = tick_us + config_.jitter_buffer_ms * 1000;
+    uint64_t now_ms = start_us / 1000;
+
+    tick_count_++;
+    game_time_ms_ = tick_count_ * 1000 / config_.tick_rate;
+
+    std::vector<network::connection_ptr> ticked;
+
+    for (auto& c : connections_) {
+      std::deque<command>& queue = c->queued_commands;
+
+      if (c->buffering_commands) {
+        if (queue.empty() || (get_queued_duration_ms(queue) < config_.jitter_buffer_ms
+            && now_ms - c->buffering_since_ms < static_cast<uint64_t>(config_.jitter_buffer_ms)))
+          continue;
+
+        c->buffering_commands = false;
+        c->command_allowance_us = 0;
+      }
+
+      c->command_allowance_us = std::min(c->command_allowance_us + tick_us, max_allowance_us);
+      ticked.push_back(c);
+    }
+
+    // every round runs the next command of each player with allowance left as one batch
+    std::vector<network::connection_ptr> running;
+    for (auto& c : ticked)
+      if (c->command_allowance_us > 0)
+        running.push_back(c);
+
+    while (running.size()) {
+      round_player_ids_.clear();
+      round_commands_.clear();
+
+      for (auto& c : running) {
+        round_player_ids_.push_back(c->player_id);
+        round_commands_.push_back(c->queued_commands.front());
+        c->command_allowance_us -= static_cast<int64_t>(round_commands_.back().duration_ms)
+            * 1000;
+        c->queued_commands.pop_front();
+      }
+
+      world_.run_commands(round_player_ids_, round_commands_);
+
+      running.erase(std::remove_if(running.begin(), running.end(),
+          [](const network::connection_ptr& c) {
+            return c->command_allowance_us <= 0 || c->queued_commands.empty();
+          }), running.end());
+    }
+
+    for (auto& c : ticked) {
+      boost::optional<player&> p = world_.get_player(c->player_id);
+      if (p)
+        grid_.update(c->player_id, p.get().get_x(), p.get().get_z());
+
+      if (c->queued_commands.empty()) {
+        c->buffering_commands = true;
+        c->command_allowance_us = 0;
+      }
+    }
+
+    history_.record(tick_count_, world_);
+
+    record_tick_cost(misc::get_time_us() - start_us);
+  }
+
+  static int get_queued_duration_ms(const std::deque<command>& queue) {
+    int duration_ms = 0;
+
+    for (const command& c : queue)
+      duration_ms += c.duration_ms;
+
+    return duration_ms;
+  }
+
+  void record_tick_cost(uint64_t cost_us) {
+    tick_cost_total_us_ += cost_us;
+    tick_cost_max_us_ = std::max(tick_cost_max_us_, cost_us);
+    tick_cost_ticks_++;
+
+    uint64_t now_ms = misc::get_time_ms();
+    if (now_ms - tick_cost_report_ms_ < static_cast<uint64_t>(TICK_COST_REPORT_INTERVAL_MS))
+      return;
+
+    tick_cost_us_ = tick_cost_total_us_ / tick_cost_ticks_;
+
+    DEBUG("tick cost, room: " << room_ << ", average: " << tick_cost_us_
+        << " us, max: " << tick_cost_max_us_ << " us, ticks: " << tick_cost_ticks_);
+
+    tick_cost_total_us_ = 0;
+    tick_cost_max_us_ = 0;
+    tick_cost_ticks_ = 0;
+    tick_cost_report_ms_ = now_ms;
+  }
+
+  void update_clients() {
+    snapshot_sequence_++;
+
+    if (!connections_.size())
+      return;
+
+    std::shared_ptr<network::world_snapshot> s(new network::world_snapshot(world_));
+    s->sequence = snapshot_sequence_;
+    s->server_time_ms = game_time_ms_;
+
+    std::shared_ptr<delta_cache> cache(new delta_cache());
+    auto self = shared_from_this();
+
+    // udp sends of the round are queued by the socket and go out together once the last
+    // connection is done
+    network::datagram_socket& socket = udp_socket_;
+    std::shared_ptr<void> flush(nullptr, [&socket](void*) { socket.flush(); });
+
+    // areas of interest need the grid, the rest is encoded on the strand of each connection
+    // from the snapshot copy, while the world moves on
+    for (auto& c : connections_) {
+      network::world_snapshot_ptr view = get_visible_snapshot(c, s);
+
+      c->strand.post([this, self, c, s, view, cache, flush]() {
+        send_snapshot(c, s, view, *cache);
+      });
+    }
+  }
+
+  void send_snapshot(network::connection_ptr c, const network::world_snapshot_ptr& s,
+      network::world_snapshot_ptr view, delta_cache& cache) {
+    world no_baseline;
+    const network::sent_snapshot* baseline = get_baseline_snapshot(c);
+    const network::world_snapshot* baseline_key = baseline ? baseline->snapshot.get() : nullptr;
+    view = get_budgeted_snapshot(c, baseline ? &baseline->snapshot->snapshot : &no_baseline,
+        view, s->snapshot);
+    network::message_buffer delta_message;
+
+    if (view == s)
+      delta_message = cache.find(baseline_key);
+
+    if (!delta_message) {
+      network::world_delta d(baseline ? baseline->snapshot->snapshot : no_baseline,
+          view->snapshot);
+      d.sequence = s->sequence;
+      d.baseline_sequence = baseline ? baseline->snapshot->sequence : 0;
+      d.server_time_ms = s->server_time_ms;
+
+      delta_message = network::make_message(d);
+
+      if (view == s)
+        cache.insert(baseline_key, delta_message);
+    }
+
+    network::message_buffer message = delta_message;
+#if _COMPRESSION
+    message = compress_message(c, message, baseline);
+#endif
+
+    // send to client, over udp if client has a working udp channel and data fits
+    bool fits = message->data.size() + network::PACKET_HEADER_SIZE
+        <= network::MAX_PACKET_SIZE;
+
+    if (c->udp_bound && (fits || c->udp_only)) {
+      network::frame f;
+      f.add(message);
+      network::write_packet(f, c->udp_token, c->channel, udp_socket_, c->udp_endpoint);
+    } else {
+      // newer snapshot replaces queued one, disconnect client if it stays too far behind
+      if (!network::write_data(message, *c->write_queue, true)) {
+        INFO("client too far behind, player id: " << std::to_string(c->player_id));
+        close_(c);
+      }
+    }
+
+    // remember snapshot as possible baseline
+    network::sent_snapshot sent;
+    sent.snapshot = view;
+    sent.message = delta_message;
+    sent.sent_ms = misc::get_time_ms();
+    c->sent_snapshots.push_back(sent);
+    if (c->sent_snapshots.size() > network::SNAPSHOT_HISTORY_SIZE)
+      c->sent_snapshots.pop_front();
+  }
+
+  // snapshot of the players in the client's area of interest, the whole world if it sees all
+  network::world_snapshot_ptr get_visible_snapshot(network::connection_ptr connection,
+      const network::world_snapshot_ptr& whole) {
+    const world& current = whole->snapshot;
+    boost::optional<const player&> own = current.get_player(connection->player_id);
+
+    // clients that have not joined see every player
+    if (!own)
+      return whole;
+
+    const player& p = own.get();
+    const interest_area& interest = config_.interest;
+    float inner = interest.radius * interest.radius;
+    float outer = (interest.radius + interest.margin) * (interest.radius + interest.margin);
+
+    std::vector<uint16_t> candidates;
+    grid_.query(p.get_x(), p.get_z(), interest.radius + interest.margin, candidates);
+
+    std::vector<uint16_t> visible;
+    const std::vector<uint16_t>& was_visible = connection->visible_player_ids;
+
+    for (uint16_t id : candidates) {
+      const player& other = current.get_player(id).get(); // grid and world change together
+      float dx = other.get_x() - p.get_x();
+      float dz = other.get_z() - p.get_z();
+      float distance = dx * dx + dz * dz;
+
+      if (distance <= inner || (distance <= outer
+          && std::binary_search(was_visible.begin(), was_visible.end(), id)))
+        visible.push_back(id);
+    }
+
+    std::sort(visible.begin(), visible.end());
+    connection->visible_player_ids = visible;
+
+    if (visible.size() == current.get_players().size())
+      return whole;
+
+    std::shared_ptr<network::world_snapshot> s(new network::world_snapshot(world()));
+    s->sequence = whole->sequence;
+    s->server_time_ms = whole->server_time_ms;
+
+    for (uint16_t id : visible)
+      s->snapshot.set_player(current.get_player(id).get());
+
+    return s;
+  }
+
+  // limits the changed players in the client's view to its byte budget, highest accumulated
+  // priority first. players left out keep their baseline state, new ones are not added yet.
+  network::world_snapshot_ptr get_budgeted_snapshot(network::connection_ptr connection,
+      const world* baseline, const network::world_snapshot_ptr& view,
+      const world& current) {
+    boost::optional<const player&> own = current.get_player(connection->player_id);
+
+    struct candidate {
+      const player* p;
+      size_t bits;
+    };
+
+    std::vector<candidate> candidates;
+    std::vector<uint8_t> scratch;
+    network::bit_writer out(scratch);
+    size_t used_bits = 0;
+
+    for (const player& p : view->snapshot.get_players()) {
+      boost::optional<const player&> from = baseline->get_player(p.get_id());
+      float& priority = connection->player_priorities[world::get_slot(p.get_id())];
+      network::player_delta d(from, p);
+
+      if (!d.fields) {
+        priority = 0;
+        continue;
+      }
+
+      size_t start_bits = out.get_bit_count();
+      d.write(out, from, p);
+      candidate c = { &p, out.get_bit_count() - start_bits };
+
+      // own player is always sent, client needs it to confirm predicted commands
+      if (p.get_id() == connection->player_id) {
+        used_bits += c.bits;
+        priority = 0;
+        continue;
+      }
+
+      priority += get_priority(own ? &own.get() : nullptr, from, p);
+      candidates.push_back(c);
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+        [connection](const candidate& a, const candidate& b) {
+          return connection->player_priorities[world::get_slot(a.p->get_id())]
+              > connection->player_priorities[world::get_slot(b.p->get_id())];
+        });
+
+    std::vector<const player*> deferred;
+
+    for (auto& c : candidates) {
+      if (used_bits + c.bits <= config_.budget.max_bytes * 8) {
+        used_bits += c.bits;
+        connection->player_priorities[world::get_slot(c.p->get_id())] = 0;
+      } else {
+        deferred.push_back(c.p);
+      }
+    }
+
+    if (deferred.empty())
+      return view;
+
+    // view with deferred players as in baseline
+    std::shared_ptr<network::world_snapshot> s(new network::world_snapshot(view->snapshot));
+    s->sequence = view->sequence;
+    s->server_time_ms = view->server_time_ms;
+
+    for (const player* p : deferred) {
+      boost::optional<const player&> from = baseline->get_player(p->get_id());
+
+      if (from)
+        s->snapshot.set_player(from.get());
+      else
+        s->snapshot.remove_player(p->get_id());
+    }
+
+    return s;
+  }
+
+  // grows with change since baseline, more for players near the client's player
+  float get_priority(const player* own, const boost::optional<const player&>& from,
+      const player& p) {
+    float change = NEW_PLAYER_PRIORITY;
+
+    if (from) {
+      float dx = p.get_x() - from.get().get_x();
+      float dy = p.get_y() - from.get().get_y();
+      float dz = p.get_z() - from.get().get_z();
+
+      change = std::sqrt(dx * dx + dy * dy + dz * dz)
+          + std::fabs(quantization::angel_difference(from.get().get_horz_angel(),
+              p.get_horz_angel()))
+          + std::fabs(quantization::angel_difference(from.get().get_vert_angel(),
+              p.get_vert_angel()));
+    }
+
+    float closeness = 1;
+
+    if (own) {
+      float dx = p.get_x() - own->get_x();
+      float dz = p.get_z() - own->get_z();
+      closeness += std::max(0.0f, 1 - std::sqrt(dx * dx + dz * dz) / config_.interest.radius);
+    }
+
+    // time since last sent is counted by adding every snapshot
+    return (1 + change) * closeness;
+  }
+
+  const network::sent_snapshot* get_baseline_snapshot(network::connection_ptr connection) {
+    auto& snapshots = connection->sent_snapshots;
+
+    // drop snapshots older than the acknowledged one, they will not be used as baseline again
+    while (snapshots.size() && snapshots.front().snapshot->sequence < connection->acked_sequence)
+      snapshots.pop_front();
+
+    if (snapshots.size() && snapshots.front().snapshot->sequence == connection->acked_sequence)
+      return &snapshots.front();
+
+    return nullptr;
+  }
+
+#if _COMPRESSION
+  // returns a compressed copy of message if smaller, the message of the acknowledged snapshot
+  // is the dictionary since the client is known to have it
+  network::message_buffer compress_message(network::connection_ptr connection,
+      const network::message_buffer& message, const network::sent_snapshot* baseline) {
+    uint64_t start_us = misc::get_time_us();
+
+    const uint8_t* body = message->data.data() + network::HEADER_SIZE;
+    const uint8_t* dictionary = baseline ? baseline->message->data.data() + network::HEADER_SIZE
+        : nullptr;
+
+    network::compressed_message m;
+    m.dictionary_sequence = baseline ? baseline->snapshot->sequence : 0;
+    m.size = message->data.size() - network::HEADER_SIZE;
+
+    if (!connection->snapshot_compressor.compress(body, m.size, dictionary,
+        baseline ? baseline->message->data.size() - network::HEADER_SIZE : 0, m.data))
+      return message;
+
+    network::message_buffer compressed = network::make_message(m);
+
+    DEBUG("compressed snapshot " << m.size << " -> " << compressed->data.size()
+        - network::HEADER_SIZE << " bytes, " << misc::get_time_us() - start_us << " us");
+
+    return compressed->data.size() < message->data.size() ? compressed : message;
+  }
+#endif
+
+  void start_client_updater() {
+    timer_.expires_from_now(
+        boost::posix_time::milliseconds(static_cast<long>(CLIENT_UPDATE_INTERVAL_MS)));
+    timer_.async_wait(
+      simulation_.wrap(boost::bind(&world_instance::handle_client_update, shared_from_this(),
+          boost::asio::placeholders::error)));
+  }
+
+  void handle_client_update(const boost::system::error_code& error) {
+    if (stopped_)
+      return;
+
+    if (!error) {
+      update_clients();
+      start_client_updater();
+    } else {
+      DEBUG("async_wait(): " << error.message());
+    }
+  }
+
+  // deadline advances by whole ticks from the previous one, so the tick rate does not drift
+  void start_tick() {
+    tick_timer_.expires_at(tick_timer_.expires_at()
+        + boost::posix_time::microseconds(1000000 / config_.tick_rate));
+    tick_timer_.async_wait(
+      simulation_.wrap(boost::bind(&world_instance::handle_tick, shared_from_this(),
+          boost::asio::placeholders::error)));
+  }
+
+  void handle_tick(const boost::system::error_code& error) {
+    if (stopped_)
+      return;
+
+    if (!error) {
+      run_tick();
+      start_tick();
+    } else {
+      DEBUG("async_wait(): " << error.message());
+    }
+  }
+
+  uint32_t room_;
+  server_config config_;
+  close_handler close_;
+
+  // game
+  world world_;
+  uint64_t game_time_ms_; // of the last tick
+  uint32_t snapshot_sequence_;
+  uint64_t tick_count_;
+  spatial_grid grid_;
+  world_history history_;
+  std::list<network::connection_ptr> connections_; // joined players
+  std::vector<uint16_t> round_player_ids_; // commands of a round of the tick, see run_tick
+  std::vector<command> round_commands_;
+
+  // simulation cost since the last report
+  uint64_t tick_cost_ticks_;
+  uint64_t tick_cost_total_us_;
+  uint64_t tick_cost_max_us_;
+  uint64_t tick_cost_report_ms_;
+  std::atomic<uint64_t> tick_cost_us_; // average of the last report, read by the server
+
+  bool stopped_; // timers are not started again
+
+  boost::asio::io_service::strand simulation_;
+  boost::asio::deadline_timer timer_; // snapshots
+  boost::asio::deadline_timer tick_timer_; // simulation
+  network::datagram_socket& udp_socket_; // of the server, snapshots to udp clients
+};
+
+#endif // WORLD_INSTANCE_HPP_